@@ -23,6 +23,7 @@
 #include <stdlib.h>
 
 #include <comp421/filesystem.h>
+#include "yfs.h"
 
 #define	INODES_PER_BLOCK	(BLOCKSIZE/INODESIZE)
 
@@ -43,6 +44,10 @@ main(int argc, char **argv)
     struct inode *inodes;
     int inodes_size;
     struct dir_entry root[2];
+    int block_bitmap_blocks;
+    int inode_bitmap_blocks;
+    int bitmap_start;
+    unsigned char *bitmap;
 
     if (argc > 1) {
 	if (sscanf(argv[1], "%d", &num_inodes) != 1) {
@@ -61,10 +66,20 @@ main(int argc, char **argv)
     inodes_size = (num_inodes + 1) * INODESIZE;
     /* force rounded up to BLOCKSIZE multiple */
     inodes_size = (inodes_size + BLOCKSIZE - 1) & ~(BLOCKSIZE - 1);
-    inodes = (struct inode *)malloc(inodes_size);
+    inodes = (struct inode *)calloc(1, inodes_size);
+
+    block_bitmap_blocks = BITMAP_BLOCKS(NUMSECTORS);
+    inode_bitmap_blocks = BITMAP_BLOCKS(num_inodes + 1);
+    bitmap_start = NUMSECTORS - block_bitmap_blocks - inode_bitmap_blocks;
 
     ((struct fs_header *)inodes)->num_blocks = NUMSECTORS;
     ((struct fs_header *)inodes)->num_inodes = num_inodes;
+    ((struct fs_header *)inodes)->padding[FS_MAGIC_SLOT] = FS_MAGIC;
+    ((struct fs_header *)inodes)->padding[FS_BLOCK_BITMAP_SLOT] = bitmap_start;
+    ((struct fs_header *)inodes)->padding[FS_INODE_BITMAP_SLOT] =
+	bitmap_start + block_bitmap_blocks;
+    ((struct fs_header *)inodes)->padding[FS_CLEAN_SLOT] = 1;
+    ((struct fs_header *)inodes)->padding[FS_FORMAT_SLOT] = FS_FORMAT_DOUBLE;
 
     inodes[1].type = INODE_DIRECTORY;
     inodes[1].nlink = 2;
@@ -97,18 +112,27 @@ main(int argc, char **argv)
     }
 
     /*
-     *  Seek to the last block of the DISK and write it full of zeros.
-     *  In Unix, this leaves a "hole" in the file, which will act
-     *  exactly as if it had been written full of zeros.  When reading
-     *  from this space skipped over here, Unix will read it as all
-     *  zeros.  By making this a hole, it is faster to run mkyfs,
-     *  and it saves real Unix disk space since a hole doesn't consume
-     *  physical disk blocks.
+     *  Write the free-block bitmap and the inode bitmap into the last
+     *  blocks of the DISK.  In use are the boot block, the header and
+     *  inode blocks, the root directory block and the bitmaps
+     *  themselves; of the inodes, the header slot 0 and the root.
+     *  Skipping from the root directory to the bitmaps leaves a "hole"
+     *  in the Unix file, which will act exactly as if it had been
+     *  written full of zeros.  By making this a hole, it is faster to
+     *  run mkyfs, and it saves real Unix disk space since a hole
+     *  doesn't consume physical disk blocks.
      */
-    lseek(disk, BLOCKSIZE * (NUMSECTORS - 1), 0);
-    memset((void *)&block, '\0', BLOCKSIZE);
-    if (write(disk, &block, BLOCKSIZE) != BLOCKSIZE) {
-	perror("write last zero");
+    bitmap = calloc(block_bitmap_blocks + inode_bitmap_blocks, BLOCKSIZE);
+    for (i = 0; i <= inodes_size / BLOCKSIZE + 1; i++)
+	bitmap[i / 8] |= 1 << (i % 8);
+    for (i = bitmap_start; i < NUMSECTORS; i++)
+	bitmap[i / 8] |= 1 << (i % 8);
+    bitmap[block_bitmap_blocks * BLOCKSIZE] |= (1 << 0) | (1 << ROOTINODE);
+
+    lseek(disk, BLOCKSIZE * bitmap_start, 0);
+    i = (block_bitmap_blocks + inode_bitmap_blocks) * BLOCKSIZE;
+    if (write(disk, bitmap, i) != i) {
+	perror("write bitmaps");
 	unlink(DISK_FILE_NAME);
 	exit(1);
     }
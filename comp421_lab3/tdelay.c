@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <comp421/yalnix.h>
+#include <comp421/iolib.h>
+#include <comp421/filesystem.h>
+
+/*
+ *  Checks that delayed writes reach the disk on Sync.  "tdelay w"
+ *  appends to a few files in small interleaved pieces, so their blocks
+ *  are allocated late, removes the last of them again, then syncs and
+ *  exits without Shutdown.  "tdelay r", on a new server, checks the
+ *  size and every byte of the files that were kept.
+ */
+
+#define FILES	3
+#define PIECE	100
+#define PIECES	60
+
+char buf[PIECES * PIECE];
+
+char *names[FILES] = { "/delay0", "/delay1", "/delaygone" };
+
+void
+Fill(int file, int start, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = (file * 13 + start + i) % 251;
+}
+
+int
+main(int argc, char **argv)
+{
+	int fd[FILES];
+	int file;
+	int piece;
+	int bad = 0;
+	struct Stat sb;
+	char want[PIECES * PIECE];
+
+	if (argc > 1 && strcmp(argv[1], "w") == 0) {
+		for (file = 0; file < FILES; file++)
+			fd[file] = Create(names[file]);
+		for (piece = 0; piece < PIECES; piece++) {
+			for (file = 0; file < FILES; file++) {
+				Fill(file, piece * PIECE, PIECE);
+				if (Write(fd[file], buf, PIECE) != PIECE)
+					bad++;
+			}
+		}
+		for (file = 0; file < FILES; file++)
+			Close(fd[file]);
+		if (Unlink(names[FILES - 1]) < 0)
+			bad++;
+		Sync();
+		printf("tdelay w: %d bad writes\n", bad);
+		return (0);
+	}
+
+	if (argc > 1 && strcmp(argv[1], "r") == 0) {
+		for (file = 0; file < FILES - 1; file++) {
+			if (Stat(names[file], &sb) < 0 || sb.size != PIECES * PIECE) {
+				bad++;
+				continue;
+			}
+			Fill(file, 0, PIECES * PIECE);
+			memcpy(want, buf, PIECES * PIECE);
+			fd[file] = Open(names[file]);
+			if (Read(fd[file], buf, PIECES * PIECE) != PIECES * PIECE ||
+			    memcmp(buf, want, PIECES * PIECE) != 0)
+				bad++;
+			Close(fd[file]);
+		}
+		if (Stat(names[FILES - 1], &sb) == 0)
+			bad++;
+		printf("tdelay r: %d bad files\n", bad);
+		printf("%s\n", bad == 0 ? "PASS" : "FAIL");
+	} else {
+		printf("usage: tdelay w|r\n");
+	}
+
+	Shutdown();
+}
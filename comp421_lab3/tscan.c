@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <comp421/yalnix.h>
+#include <comp421/iolib.h>
+#include <comp421/filesystem.h>
+
+/*
+ *  Checks that a mount after an unclean shutdown rebuilds the free
+ *  lists from what is on disk.  "tscan w" writes a file past the
+ *  single-indirect limit, syncs, then dirties the disk again and exits
+ *  without Sync or Shutdown.  "tscan r", on a new server, reads the file
+ *  back, writes a second one as large, and reads the first again, which
+ *  shows any block the scan missed being handed out twice.
+ *
+ *  Run the server with -f 0 for "tscan w", so the flusher does not
+ *  sync behind it.
+ */
+
+#define BLOCKS	200
+
+char buf[BLOCKSIZE];
+
+void
+Fill(int seed, int block)
+{
+	int i;
+
+	for (i = 0; i < BLOCKSIZE; i++)
+		buf[i] = seed + block * 7 + i;
+}
+
+int
+WriteBig(char *name, int seed)
+{
+	int fd;
+	int block;
+	int bad = 0;
+
+	fd = Create(name);
+	if (fd < 0)
+		return BLOCKS;
+	for (block = 0; block < BLOCKS; block++) {
+		Fill(seed, block);
+		if (Write(fd, buf, BLOCKSIZE) != BLOCKSIZE)
+			bad++;
+	}
+	Close(fd);
+	return bad;
+}
+
+int
+CheckBig(char *name, int seed)
+{
+	char want[BLOCKSIZE];
+	int fd;
+	int block;
+	int bad = 0;
+
+	fd = Open(name);
+	if (fd < 0)
+		return BLOCKS;
+	for (block = 0; block < BLOCKS; block++) {
+		Fill(seed, block);
+		memcpy(want, buf, BLOCKSIZE);
+		if (Read(fd, buf, BLOCKSIZE) != BLOCKSIZE ||
+		    memcmp(buf, want, BLOCKSIZE) != 0)
+			bad++;
+	}
+	Close(fd);
+	return bad;
+}
+
+int
+main(int argc, char **argv)
+{
+	int bad;
+
+	if (argc > 1 && strcmp(argv[1], "w") == 0) {
+		bad = WriteBig("/scan1", 1);
+		Sync();
+		Create("/scan.tmp");
+		printf("tscan w: %d bad blocks\n", bad);
+		return (0);
+	}
+
+	if (argc > 1 && strcmp(argv[1], "r") == 0) {
+		bad = CheckBig("/scan1", 1);
+		bad += WriteBig("/scan2", 2);
+		Sync();
+		bad += CheckBig("/scan1", 1);
+		bad += CheckBig("/scan2", 2);
+		printf("tscan r: %d bad blocks\n", bad);
+		printf("%s\n", bad == 0 ? "PASS" : "FAIL");
+	} else {
+		printf("usage: tscan w|r\n");
+	}
+
+	Shutdown();
+}
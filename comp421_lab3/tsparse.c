@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <comp421/yalnix.h>
+#include <comp421/iolib.h>
+#include <comp421/filesystem.h>
+
+/*
+ *  Writes a file with holes, in the direct blocks and past the
+ *  single-indirect limit, plus a block of zeros, then fills part of a
+ *  hole, and reads the whole file back before and after a Sync.  The
+ *  holes must read as zeros.
+ */
+
+#define FILESIZE	(151 * BLOCKSIZE)
+
+char image[FILESIZE];
+char buf[FILESIZE];
+char zeros[BLOCKSIZE];
+
+int bad = 0;
+
+void
+WriteAt(int fd, int offset, char *data, int len)
+{
+	Seek(fd, offset, SEEK_SET);
+	if (Write(fd, data, len) != len)
+		bad++;
+	memcpy(image + offset, data, len);
+}
+
+void
+Check(int fd, int size)
+{
+	struct Stat sb;
+
+	if (Stat("/sparse", &sb) < 0 || sb.size != size)
+		bad++;
+	Seek(fd, 0, SEEK_SET);
+	if (Read(fd, buf, FILESIZE) != size || memcmp(buf, image, size) != 0)
+		bad++;
+}
+
+int
+main()
+{
+	int fd;
+
+	fd = Create("/sparse");
+	if (fd < 0) {
+		printf("tsparse: cannot create /sparse\n");
+		Shutdown();
+	}
+
+	WriteAt(fd, 5 * BLOCKSIZE + 100, "hello, sparse world", 19);
+	WriteAt(fd, 8 * BLOCKSIZE, zeros, BLOCKSIZE);
+	WriteAt(fd, 9 * BLOCKSIZE, "after the zeros", 15);
+	Check(fd, 9 * BLOCKSIZE + 15);
+
+	WriteAt(fd, 150 * BLOCKSIZE, "far", 3);
+	WriteAt(fd, 2 * BLOCKSIZE + 10, "xyz", 3);
+	Check(fd, 150 * BLOCKSIZE + 3);
+
+	Sync();
+	Check(fd, 150 * BLOCKSIZE + 3);
+
+	WriteAt(fd, 100 * BLOCKSIZE - 2, "across", 6);
+	Sync();
+	Check(fd, 150 * BLOCKSIZE + 3);
+	Close(fd);
+
+	printf("tsparse: %d bad\n", bad);
+	printf("%s\n", bad == 0 ? "PASS" : "FAIL");
+
+	Shutdown();
+}
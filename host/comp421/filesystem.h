@@ -0,0 +1,4 @@
+/*
+ *  Host-native build: use the file system format from the top level.
+ */
+#include "../../filesystem.h"
@@ -0,0 +1,18 @@
+/*
+ *  Host-native stand-in for the Yalnix <comp421/hardware.h>.
+ *
+ *  Only the disk geometry used by YFS and mkyfs is defined here.
+ *  NUMSECTORS may be overridden on the compiler command line to
+ *  build servers and DISK images of other sizes.
+ */
+
+#ifndef _hardware_h
+#define _hardware_h
+
+#define	SECTORSIZE	512	/* size of a disk sector in bytes */
+
+#ifndef NUMSECTORS
+#define	NUMSECTORS	1426	/* number of sectors on the disk */
+#endif
+
+#endif /* _hardware_h */
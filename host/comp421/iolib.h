@@ -0,0 +1,4 @@
+/*
+ *  Host-native build: use the YFS library interface from the top level.
+ */
+#include "../../iolib.h"
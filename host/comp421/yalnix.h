@@ -0,0 +1,30 @@
+/*
+ *  Host-native stand-in for the Yalnix <comp421/yalnix.h>.
+ *
+ *  Declares the subset of Yalnix kernel calls used by YFS, its
+ *  library and the test programs.  They are implemented on top of
+ *  ordinary Linux processes by host/yalnix.c.
+ */
+
+#ifndef _yalnix_h
+#define _yalnix_h
+
+#define	ERROR	(-1)
+
+extern int Fork(void);
+extern int Exec(char *, char **);
+extern void Exit(int) __attribute__ ((noreturn));
+extern int Wait(int *);
+extern int GetPid(void);
+extern int Delay(int);
+extern int Register(unsigned int);
+extern int Send(void *, int);
+extern int Receive(void *);
+extern int Reply(void *, int);
+extern int CopyFrom(int, void *, void *, int);
+extern int CopyTo(int, void *, void *, int);
+extern int ReadSector(int, void *);
+extern int WriteSector(int, void *);
+extern void TracePrintf(int, char *, ...);
+
+#endif /* _yalnix_h */
@@ -0,0 +1,591 @@
+/*
+ *  Host-native stand-in for the Yalnix kernel calls used by YFS.
+ *
+ *  Every Yalnix process is an ordinary Linux process.  The first
+ *  process (normally yfs-host) creates a shared memory region and
+ *  publishes it to its descendants through the YFS_HOST_SHM
+ *  environment variable, so Fork and Exec keep working.  Messages
+ *  are passed through per-process slots in that region; CopyFrom
+ *  and CopyTo are served by the blocked sender itself, which copies
+ *  through its slot's staging buffer while it waits for its Reply.
+ *
+ *  The disk is the Unix file named by YFS_DISK (default "DISK").
+ *  An optional latency model charges YFS_SECTOR_US microseconds per
+ *  sector transferred plus YFS_SEEK_US microseconds for a full-stroke
+ *  seek, scaled by the distance the head moves; the caller sleeps for
+ *  it, as a Yalnix process blocks on the disk.  TracePrintf output
+ *  goes to stderr for levels up to YFS_TRACE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <comp421/yalnix.h>
+#include <comp421/hardware.h>
+
+#define HOST_MAX_PROCS      32
+#define HOST_MAX_SERVICES   8
+#define HOST_MSG_SIZE       32
+#define HOST_COPY_CHUNK     (64 * 1024)
+#define HOST_TICK_US        10000
+#define HOST_POLL_MS        100
+
+#define PROC_FREE       0
+#define PROC_RUNNING    1
+#define PROC_SENDING    2
+#define PROC_RECEIVED   3
+#define PROC_REPLIED    4
+#define PROC_DEAD       5
+
+#define COPY_IDLE       0
+#define COPY_FROM       1
+#define COPY_TO         2
+#define COPY_DONE       3
+#define COPY_FAULT      4
+
+struct host_proc {
+    pid_t pid;
+    int state;
+    int receiver;       /* slot this process is sending to */
+    int next;           /* next slot in the receiver's queue */
+    int queue_head;     /* senders waiting for this process */
+    int queue_tail;
+    int copy_op;
+    char *copy_addr;
+    int copy_len;
+    pthread_cond_t wake;
+    char msg[HOST_MSG_SIZE];
+    char stage[HOST_COPY_CHUNK];
+};
+
+struct host_disk {
+    long reads;
+    long writes;
+    long long seek_sectors;
+    long long busy_ns;
+    int head;
+};
+
+struct host_shared {
+    pthread_mutex_t lock;
+    int services[HOST_MAX_SERVICES];
+    struct host_disk disk;
+    struct host_proc procs[HOST_MAX_PROCS];
+};
+
+struct host_shared *shared;
+struct host_proc *self;
+
+int disk_fd = -1;
+long long sector_ns;
+long long seek_ns;
+int trace_level;
+int exiting;
+
+sigjmp_buf copy_jmp;
+volatile sig_atomic_t copying;
+
+/*****************
+ * Process Slots *
+ *****************/
+
+/*
+ * Current monotonic time in nanoseconds.
+ */
+long long HostClock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Find the slot of a live process.
+ */
+struct host_proc *FindProc(pid_t pid) {
+    int i;
+    for (i = 0; i < HOST_MAX_PROCS; i++) {
+        struct host_proc *proc = &shared->procs[i];
+        if (proc->pid == pid && proc->state != PROC_FREE && proc->state != PROC_DEAD) {
+            return proc;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Claim the slot of a process, or find the one already claimed.
+ */
+struct host_proc *ClaimProc(pid_t pid) {
+    pthread_mutex_lock(&shared->lock);
+    struct host_proc *proc = FindProc(pid);
+    int i;
+    for (i = 0; proc == NULL && i < HOST_MAX_PROCS; i++) {
+        if (shared->procs[i].state == PROC_FREE || shared->procs[i].state == PROC_DEAD) {
+            proc = &shared->procs[i];
+            proc->pid = pid;
+            proc->state = PROC_RUNNING;
+            proc->queue_head = -1;
+            proc->queue_tail = -1;
+            proc->copy_op = COPY_IDLE;
+        }
+    }
+    pthread_mutex_unlock(&shared->lock);
+    if (proc == NULL) {
+        fprintf(stderr, "yalnix: out of process slots\n");
+        _exit(1);
+    }
+    return proc;
+}
+
+/*
+ * Mark a process dead and wake everybody that may be waiting on it.
+ * Called with the lock held.
+ */
+void BuryProc(struct host_proc *proc) {
+    int i;
+    proc->state = PROC_DEAD;
+    for (i = 0; i < HOST_MAX_SERVICES; i++) {
+        if (shared->services[i] == proc - shared->procs) {
+            shared->services[i] = -1;
+        }
+    }
+    for (i = 0; i < HOST_MAX_PROCS; i++) {
+        pthread_cond_broadcast(&shared->procs[i].wake);
+    }
+}
+
+/*
+ * Notice processes that went away without calling Exit.
+ * Called with the lock held.
+ */
+void ReapProcs() {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        struct host_proc *proc = FindProc(pid);
+        if (proc != NULL) BuryProc(proc);
+    }
+
+    int i;
+    for (i = 0; i < HOST_MAX_PROCS; i++) {
+        struct host_proc *proc = &shared->procs[i];
+        if (proc->state == PROC_FREE || proc->state == PROC_DEAD) continue;
+        if (kill(proc->pid, 0) < 0 && errno == ESRCH) {
+            BuryProc(proc);
+        }
+    }
+}
+
+/*
+ * Wait on our own condition variable for at most HOST_POLL_MS.
+ * Called with the lock held.
+ */
+void WaitSelf() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_nsec += HOST_POLL_MS * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    if (pthread_cond_timedwait(&self->wake, &shared->lock, &ts) == ETIMEDOUT) {
+        ReapProcs();
+    }
+}
+
+/*
+ * Bury the calling process on its way out.
+ */
+void LeaveProc() {
+    if (exiting || shared == NULL || self == NULL) {
+        return;
+    }
+    exiting = 1;
+    pthread_mutex_lock(&shared->lock);
+    BuryProc(self);
+    pthread_mutex_unlock(&shared->lock);
+}
+
+/*
+ * A bad address in a CopyFrom or CopyTo makes the call fail, as in
+ * Yalnix, instead of killing the sender while it holds the lock.
+ */
+void CopyFault(int sig) {
+    if (copying) {
+        siglongjmp(copy_jmp, 1);
+    }
+    signal(sig, SIG_DFL);
+}
+
+/*
+ * Copy on behalf of the receiver, catching bad addresses.
+ */
+int SafeCopy(char *dest, char *src, int len) {
+    if (sigsetjmp(copy_jmp, 1) != 0) {
+        copying = 0;
+        return COPY_FAULT;
+    }
+    copying = 1;
+    memcpy(dest, src, len);
+    copying = 0;
+    return COPY_DONE;
+}
+
+/*
+ * Attach to the shared region, creating it in the first process.
+ */
+__attribute__((constructor))
+void HostInit() {
+    char *env = getenv("YFS_HOST_SHM");
+    int fd;
+
+    if (env != NULL) {
+        fd = atoi(env);
+    } else {
+        char buf[16];
+        fd = memfd_create("yfs-host", 0);
+        if (fd < 0 || ftruncate(fd, sizeof(struct host_shared)) < 0) {
+            perror("yalnix: memfd");
+            _exit(1);
+        }
+        snprintf(buf, sizeof(buf), "%d", fd);
+        setenv("YFS_HOST_SHM", buf, 1);
+    }
+
+    shared = mmap(NULL, sizeof(struct host_shared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shared == MAP_FAILED) {
+        perror("yalnix: mmap");
+        _exit(1);
+    }
+
+    if (env == NULL) {
+        pthread_mutexattr_t mattr;
+        pthread_condattr_t cattr;
+        int i;
+
+        pthread_mutexattr_init(&mattr);
+        pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+        pthread_mutex_init(&shared->lock, &mattr);
+        pthread_condattr_init(&cattr);
+        pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+        pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+        for (i = 0; i < HOST_MAX_PROCS; i++) {
+            pthread_cond_init(&shared->procs[i].wake, &cattr);
+        }
+        for (i = 0; i < HOST_MAX_SERVICES; i++) {
+            shared->services[i] = -1;
+        }
+    }
+
+    if ((env = getenv("YFS_SECTOR_US")) != NULL) sector_ns = atoll(env) * 1000;
+    if ((env = getenv("YFS_SEEK_US")) != NULL) seek_ns = atoll(env) * 1000;
+    if ((env = getenv("YFS_TRACE")) != NULL) trace_level = atoi(env);
+
+    signal(SIGSEGV, CopyFault);
+    signal(SIGBUS, CopyFault);
+
+    self = ClaimProc(getpid());
+    atexit(LeaveProc);
+}
+
+/*****************
+ * Process Calls *
+ *****************/
+
+int Fork() {
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0) {
+        return ERROR;
+    }
+    /* Both sides claim the slot so the parent never sees the child missing */
+    if (pid == 0) {
+        self = ClaimProc(getpid());
+    } else {
+        ClaimProc(pid);
+    }
+    return pid;
+}
+
+int Exec(char *filename, char **argv) {
+    execvp(filename, argv);
+    return ERROR;
+}
+
+void Exit(int status) {
+    if (disk_fd >= 0) {
+        fsync(disk_fd);
+    }
+    exit(status);
+}
+
+int Wait(int *status_ptr) {
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid < 0) {
+        return ERROR;
+    }
+    if (status_ptr != NULL) {
+        *status_ptr = WIFEXITED(status) ? WEXITSTATUS(status) : ERROR;
+    }
+    return pid;
+}
+
+int GetPid() {
+    return getpid();
+}
+
+int Delay(int clock_ticks) {
+    if (clock_ticks < 0) {
+        return ERROR;
+    }
+    usleep(clock_ticks * HOST_TICK_US);
+    return 0;
+}
+
+void TracePrintf(int level, char *fmt, ...) {
+    if (level > trace_level) {
+        return;
+    }
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+/************
+ * Messages *
+ ************/
+
+int Register(unsigned int service_id) {
+    if (service_id >= HOST_MAX_SERVICES) {
+        return ERROR;
+    }
+    pthread_mutex_lock(&shared->lock);
+    int result = ERROR;
+    if (shared->services[service_id] < 0) {
+        shared->services[service_id] = self - shared->procs;
+        result = 0;
+    }
+    pthread_mutex_unlock(&shared->lock);
+    return result;
+}
+
+int Send(void *msg, int pid) {
+    pthread_mutex_lock(&shared->lock);
+    struct host_proc *receiver = NULL;
+    if (pid < 0 && -pid < HOST_MAX_SERVICES && shared->services[-pid] >= 0) {
+        receiver = &shared->procs[shared->services[-pid]];
+    } else if (pid > 0) {
+        receiver = FindProc(pid);
+    }
+    if (receiver == NULL || receiver == self) {
+        pthread_mutex_unlock(&shared->lock);
+        return ERROR;
+    }
+
+    memcpy(self->msg, msg, HOST_MSG_SIZE);
+    self->state = PROC_SENDING;
+    self->receiver = receiver - shared->procs;
+    self->copy_op = COPY_IDLE;
+    self->next = -1;
+    if (receiver->queue_tail < 0) {
+        receiver->queue_head = self - shared->procs;
+    } else {
+        shared->procs[receiver->queue_tail].next = self - shared->procs;
+    }
+    receiver->queue_tail = self - shared->procs;
+    pthread_cond_signal(&receiver->wake);
+
+    while (self->state != PROC_REPLIED) {
+        if (self->copy_op == COPY_FROM) {
+            self->copy_op = SafeCopy(self->stage, self->copy_addr, self->copy_len);
+            pthread_cond_signal(&receiver->wake);
+        } else if (self->copy_op == COPY_TO) {
+            self->copy_op = SafeCopy(self->copy_addr, self->stage, self->copy_len);
+            pthread_cond_signal(&receiver->wake);
+        } else if (receiver->state == PROC_DEAD) {
+            self->state = PROC_RUNNING;
+            pthread_mutex_unlock(&shared->lock);
+            return ERROR;
+        } else {
+            WaitSelf();
+        }
+    }
+
+    memcpy(msg, self->msg, HOST_MSG_SIZE);
+    self->state = PROC_RUNNING;
+    pthread_mutex_unlock(&shared->lock);
+    return 0;
+}
+
+int Receive(void *msg) {
+    pthread_mutex_lock(&shared->lock);
+    while (1) {
+        while (self->queue_head >= 0 && shared->procs[self->queue_head].state != PROC_SENDING) {
+            self->queue_head = shared->procs[self->queue_head].next;
+        }
+        if (self->queue_head >= 0) {
+            break;
+        }
+        self->queue_tail = -1;
+
+        int i;
+        int others = 0;
+        for (i = 0; i < HOST_MAX_PROCS; i++) {
+            struct host_proc *proc = &shared->procs[i];
+            if (proc != self && proc->state != PROC_FREE && proc->state != PROC_DEAD) {
+                others++;
+            }
+        }
+        if (others == 0) {
+            pthread_mutex_unlock(&shared->lock);
+            fprintf(stderr, "yalnix: no processes left, halting\n");
+            Exit(0);
+        }
+        WaitSelf();
+    }
+
+    struct host_proc *sender = &shared->procs[self->queue_head];
+    self->queue_head = sender->next;
+    if (self->queue_head < 0) {
+        self->queue_tail = -1;
+    }
+    sender->state = PROC_RECEIVED;
+    memcpy(msg, sender->msg, HOST_MSG_SIZE);
+    pthread_mutex_unlock(&shared->lock);
+    return sender->pid;
+}
+
+int Reply(void *msg, int pid) {
+    pthread_mutex_lock(&shared->lock);
+    struct host_proc *sender = FindProc(pid);
+    if (sender == NULL || sender->state != PROC_RECEIVED || sender->receiver != self - shared->procs) {
+        pthread_mutex_unlock(&shared->lock);
+        return ERROR;
+    }
+    memcpy(sender->msg, msg, HOST_MSG_SIZE);
+    sender->state = PROC_REPLIED;
+    pthread_cond_signal(&sender->wake);
+    pthread_mutex_unlock(&shared->lock);
+    return 0;
+}
+
+/*
+ * Have the blocked sender copy one direction through its staging buffer.
+ */
+int CopyChunks(int op, int pid, char *local, char *remote, int len) {
+    if (len < 0) {
+        return ERROR;
+    }
+    pthread_mutex_lock(&shared->lock);
+    struct host_proc *sender = FindProc(pid);
+    if (sender == NULL || sender->state != PROC_RECEIVED || sender->receiver != self - shared->procs) {
+        pthread_mutex_unlock(&shared->lock);
+        return ERROR;
+    }
+
+    int done = 0;
+    while (done < len) {
+        int n = len - done;
+        if (n > HOST_COPY_CHUNK) n = HOST_COPY_CHUNK;
+
+        if (op == COPY_TO) memcpy(sender->stage, local + done, n);
+        sender->copy_addr = remote + done;
+        sender->copy_len = n;
+        sender->copy_op = op;
+        pthread_cond_signal(&sender->wake);
+        while (sender->copy_op != COPY_DONE) {
+            if (sender->state == PROC_DEAD || sender->copy_op == COPY_FAULT) {
+                sender->copy_op = COPY_IDLE;
+                pthread_mutex_unlock(&shared->lock);
+                return ERROR;
+            }
+            WaitSelf();
+        }
+        sender->copy_op = COPY_IDLE;
+        if (op == COPY_FROM) memcpy(local + done, sender->stage, n);
+        done += n;
+    }
+    pthread_mutex_unlock(&shared->lock);
+    return 0;
+}
+
+int CopyFrom(int srcpid, void *dest, void *src, int len) {
+    return CopyChunks(COPY_FROM, srcpid, dest, src, len);
+}
+
+int CopyTo(int destpid, void *dest, void *src, int len) {
+    return CopyChunks(COPY_TO, destpid, src, dest, len);
+}
+
+/********
+ * Disk *
+ ********/
+
+/*
+ * Open the DISK file and charge the latency model for one sector.
+ */
+int DiskAccess(int sector) {
+    if (sector < 0 || sector >= NUMSECTORS) {
+        return ERROR;
+    }
+    if (disk_fd < 0) {
+        char *name = getenv("YFS_DISK");
+        if (name == NULL) name = "DISK";
+        if ((disk_fd = open(name, O_RDWR)) < 0) {
+            perror(name);
+            return ERROR;
+        }
+    }
+
+    int distance = sector - shared->disk.head;
+    if (distance < 0) distance = -distance;
+    shared->disk.head = sector + 1;
+    shared->disk.seek_sectors += distance;
+
+    long long cost = sector_ns + seek_ns * distance / NUMSECTORS;
+    if (cost > 0) {
+        /* Sleep rather than spin, so other processes run during the transfer */
+        long long until = HostClock() + cost;
+        struct timespec ts = { until / 1000000000LL, until % 1000000000LL };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+            continue;
+        }
+        shared->disk.busy_ns += cost;
+    }
+    return 0;
+}
+
+int ReadSector(int sector, void *buf) {
+    if (DiskAccess(sector) < 0) {
+        return ERROR;
+    }
+    if (pread(disk_fd, buf, SECTORSIZE, (off_t)sector * SECTORSIZE) != SECTORSIZE) {
+        return ERROR;
+    }
+    shared->disk.reads++;
+    return 0;
+}
+
+int WriteSector(int sector, void *buf) {
+    if (DiskAccess(sector) < 0) {
+        return ERROR;
+    }
+    if (pwrite(disk_fd, buf, SECTORSIZE, (off_t)sector * SECTORSIZE) != SECTORSIZE) {
+        return ERROR;
+    }
+    shared->disk.writes++;
+    return 0;
+}
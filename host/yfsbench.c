@@ -0,0 +1,767 @@
+/*
+ *  YFS workload benchmark.
+ *
+ *  Runs parameterized workloads through the YFS library and prints
+ *  one JSON document with, for every phase of every workload, the
+ *  throughput, p50/p99 latency, sectors read and written per
+ *  operation, the block/inode/name cache hit ratios, the blocks
+ *  allocated per operation, the average run of contiguous blocks
+ *  allocated, the head movement per sector read and the share of
+ *  file block lookups answered by the inode's block map over the
+ *  phase.  The server counters come from MSG_STATS.
+ *
+ *  Usage: yfsbench [-n files] [-d depth] [-s bytes] [-o ops] [-r seed]
+ *                  [workload ...]
+ *
+ *  Workloads: small, deep, seq, bulk, rand, fanout, scan, chunkscan,
+ *  aged, sparse (default: all of them).
+ *
+ *  This is a host program: run it as "./yfs-host host/bin/yfsbench".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <comp421/yalnix.h>
+#include <comp421/iolib.h>
+#include <comp421/filesystem.h>
+#include "../packet.h"
+
+#define MAX_PHASE_OPS   4096
+#define NAME_LEN        64
+#define AGED_FILES      4
+#define BULK_OPS        32
+#define HOT_BLOCKS      4
+
+struct phase {
+    char *op;
+    int ops;
+    int errors;
+    long long start;
+    long long lat[MAX_PHASE_OPS];
+    ServerStats before;
+};
+
+int num_files = 32;
+int depth = 8;
+int file_size = 64 * 1024;
+int num_ops = 256;
+int chunk_size = 256;
+
+int first_workload = 1;
+int first_phase = 1;
+char *io_buf;
+
+/*
+ * Current monotonic time in nanoseconds.
+ */
+long long Now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Fetch the server counters.
+ */
+void GetServerStats(ServerStats *stats) {
+    DataPacket *packet = malloc(PACKET_SIZE);
+    memset(packet, 0, PACKET_SIZE);
+    memset(stats, 0, sizeof(ServerStats));
+    packet->packet_type = MSG_STATS;
+    packet->pointer = (void *)stats;
+    Send(packet, -FILE_SERVER);
+    free(packet);
+}
+
+/*************
+ * Reporting *
+ *************/
+
+int CompareLatency(const void *a, const void *b) {
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Nearest-rank percentile of sorted latencies, in microseconds.
+ */
+double Percentile(long long *lat, int n, double p) {
+    if (n == 0) {
+        return 0;
+    }
+    int rank = (int)(p * n + 0.999999);
+    if (rank < 1) rank = 1;
+    return lat[rank - 1] / 1000.0;
+}
+
+double Ratio(int num, int den) {
+    return den == 0 ? 0 : (double)num / den;
+}
+
+void BeginWorkload(char *name) {
+    printf("%s\n    {\"name\": \"%s\", \"phases\": [", first_workload ? "" : ",", name);
+    first_workload = 0;
+    first_phase = 1;
+}
+
+void EndWorkload() {
+    printf("\n    ]}");
+}
+
+void BeginPhase(struct phase *ph, char *op) {
+    ph->op = op;
+    ph->ops = 0;
+    ph->errors = 0;
+    GetServerStats(&ph->before);
+    ph->start = Now();
+}
+
+/*
+ * Record one operation that started at t0.
+ */
+void Record(struct phase *ph, long long t0, int failed) {
+    if (ph->ops < MAX_PHASE_OPS) {
+        ph->lat[ph->ops++] = Now() - t0;
+    }
+    if (failed) {
+        ph->errors++;
+    }
+}
+
+void EndPhase(struct phase *ph) {
+    double seconds = (Now() - ph->start) / 1e9;
+    ServerStats after;
+    GetServerStats(&after);
+
+    int reads = after.sector_reads - ph->before.sector_reads;
+    int writes = after.sector_writes - ph->before.sector_writes;
+    int bhits = after.block_hits - ph->before.block_hits;
+    int bmiss = after.block_misses - ph->before.block_misses;
+    int ihits = after.inode_hits - ph->before.inode_hits;
+    int imiss = after.inode_misses - ph->before.inode_misses;
+    int nhits = after.name_hits - ph->before.name_hits;
+    int nmiss = after.name_misses - ph->before.name_misses;
+    int allocs = after.alloc_blocks - ph->before.alloc_blocks;
+    int runs = after.alloc_runs - ph->before.alloc_runs;
+    int seek = after.read_seek_distance - ph->before.read_seek_distance;
+    int mhits = after.map_hits - ph->before.map_hits;
+    int mmiss = after.map_misses - ph->before.map_misses;
+
+    qsort(ph->lat, ph->ops, sizeof(long long), CompareLatency);
+    printf("%s\n      {\"op\": \"%s\", \"ops\": %d, \"errors\": %d, \"seconds\": %.6f, "
+           "\"ops_per_sec\": %.1f, \"p50_us\": %.2f, \"p99_us\": %.2f, \"max_us\": %.2f, "
+           "\"sector_reads_per_op\": %.3f, \"sector_writes_per_op\": %.3f, "
+           "\"block_hit_ratio\": %.4f, \"inode_hit_ratio\": %.4f, \"name_hit_ratio\": %.4f, "
+           "\"allocs_per_op\": %.3f, \"avg_run_blocks\": %.2f, \"seek_per_read\": %.2f, "
+           "\"map_hit_ratio\": %.4f, \"cache_entries\": [%d, %d, %d]}",
+           first_phase ? "" : ",", ph->op, ph->ops, ph->errors, seconds,
+           seconds > 0 ? ph->ops / seconds : 0,
+           Percentile(ph->lat, ph->ops, 0.50), Percentile(ph->lat, ph->ops, 0.99),
+           Percentile(ph->lat, ph->ops, 1.0),
+           Ratio(reads, ph->ops), Ratio(writes, ph->ops),
+           Ratio(bhits, bhits + bmiss), Ratio(ihits, ihits + imiss), Ratio(nhits, nhits + nmiss),
+           Ratio(allocs, ph->ops), Ratio(allocs, runs), Ratio(seek, reads),
+           Ratio(mhits, mhits + mmiss),
+           after.block_cache_entries, after.inode_cache_entries, after.name_cache_entries);
+    first_phase = 0;
+}
+
+/*
+ * Time a single Sync as its own phase.
+ */
+void SyncPhase(struct phase *ph) {
+    BeginPhase(ph, "sync");
+    long long t0 = Now();
+    Record(ph, t0, Sync() < 0);
+    EndPhase(ph);
+}
+
+/*************
+ * Workloads *
+ *************/
+
+/*
+ * Many small files in one directory: create, write, lookup, read, unlink.
+ */
+void SmallFiles(struct phase *ph) {
+    char name[NAME_LEN];
+    int i;
+    int fd;
+
+    BeginWorkload("small");
+    MkDir("/small");
+
+    BeginPhase(ph, "create");
+    for (i = 0; i < num_files; i++) {
+        sprintf(name, "/small/f%03d", i);
+        long long t0 = Now();
+        fd = Create(name);
+        Record(ph, t0, fd < 0);
+        Close(fd);
+    }
+    EndPhase(ph);
+
+    BeginPhase(ph, "write");
+    for (i = 0; i < num_files; i++) {
+        sprintf(name, "/small/f%03d", i);
+        long long t0 = Now();
+        fd = Open(name);
+        Record(ph, t0, Write(fd, io_buf, chunk_size) != chunk_size);
+        Close(fd);
+    }
+    EndPhase(ph);
+
+    BeginPhase(ph, "lookup");
+    for (i = 0; i < num_files; i++) {
+        struct Stat sb;
+        sprintf(name, "/small/f%03d", i);
+        long long t0 = Now();
+        Record(ph, t0, Stat(name, &sb) < 0);
+    }
+    EndPhase(ph);
+
+    BeginPhase(ph, "read");
+    for (i = 0; i < num_files; i++) {
+        sprintf(name, "/small/f%03d", i);
+        long long t0 = Now();
+        fd = Open(name);
+        Record(ph, t0, Read(fd, io_buf, chunk_size) != chunk_size);
+        Close(fd);
+    }
+    EndPhase(ph);
+
+    BeginPhase(ph, "unlink");
+    for (i = 0; i < num_files; i++) {
+        sprintf(name, "/small/f%03d", i);
+        long long t0 = Now();
+        Record(ph, t0, Unlink(name) < 0);
+    }
+    EndPhase(ph);
+
+    SyncPhase(ph);
+    RmDir("/small");
+    EndWorkload();
+}
+
+/*
+ * Lookups through a chain of nested directories.
+ */
+void DeepPaths(struct phase *ph) {
+    char path[MAXPATHNAMELEN];
+    int i;
+    int fd;
+
+    BeginWorkload("deep");
+    strcpy(path, "/deep");
+    MkDir(path);
+
+    BeginPhase(ph, "mkdir");
+    for (i = 0; i < depth; i++) {
+        sprintf(path + strlen(path), "/d%d", i);
+        long long t0 = Now();
+        Record(ph, t0, MkDir(path) < 0);
+    }
+    EndPhase(ph);
+
+    strcat(path, "/leaf");
+    fd = Create(path);
+    Close(fd);
+
+    BeginPhase(ph, "lookup");
+    for (i = 0; i < num_ops; i++) {
+        struct Stat sb;
+        long long t0 = Now();
+        Record(ph, t0, Stat(path, &sb) < 0);
+    }
+    EndPhase(ph);
+
+    BeginPhase(ph, "open");
+    for (i = 0; i < num_ops; i++) {
+        long long t0 = Now();
+        fd = Open(path);
+        Record(ph, t0, fd < 0);
+        Close(fd);
+    }
+    EndPhase(ph);
+
+    Unlink(path);
+    *strrchr(path, '/') = '\0';
+    for (i = 0; i < depth; i++) {
+        RmDir(path);
+        *strrchr(path, '/') = '\0';
+    }
+    RmDir("/deep");
+
+    SyncPhase(ph);
+    EndWorkload();
+}
+
+/*
+ * One large file written and read sequentially, one block per call,
+ * crossing from the direct blocks into the indirect block.
+ */
+void SequentialLarge(struct phase *ph) {
+    int fd;
+    int pos;
+
+    BeginWorkload("seq");
+    fd = Create("/seq");
+
+    BeginPhase(ph, "write");
+    for (pos = 0; pos < file_size; pos += BLOCKSIZE) {
+        long long t0 = Now();
+        Record(ph, t0, Write(fd, io_buf, BLOCKSIZE) != BLOCKSIZE);
+    }
+    EndPhase(ph);
+
+    SyncPhase(ph);
+
+    Seek(fd, 0, SEEK_SET);
+    BeginPhase(ph, "read");
+    for (pos = 0; pos < file_size; pos += BLOCKSIZE) {
+        long long t0 = Now();
+        Record(ph, t0, Read(fd, io_buf, BLOCKSIZE) != BLOCKSIZE);
+    }
+    EndPhase(ph);
+
+    Close(fd);
+    Unlink("/seq");
+    EndWorkload();
+}
+
+/*
+ * The whole large file written and read back in one call each, over
+ * and over: a transfer's cost is then mostly the copy to or from the
+ * client rather than per-block work.
+ */
+void BulkTransfer(struct phase *ph) {
+    int fd;
+    int i;
+
+    BeginWorkload("bulk");
+    fd = Create("/bulk");
+
+    BeginPhase(ph, "write");
+    for (i = 0; i < BULK_OPS; i++) {
+        Seek(fd, 0, SEEK_SET);
+        long long t0 = Now();
+        Record(ph, t0, Write(fd, io_buf, file_size) != file_size);
+    }
+    EndPhase(ph);
+
+    SyncPhase(ph);
+
+    BeginPhase(ph, "read");
+    for (i = 0; i < BULK_OPS; i++) {
+        Seek(fd, 0, SEEK_SET);
+        long long t0 = Now();
+        Record(ph, t0, Read(fd, io_buf, file_size) != file_size);
+    }
+    EndPhase(ph);
+
+    Close(fd);
+    Unlink("/bulk");
+    EndWorkload();
+}
+
+/*
+ * Random-offset overwrites and reads within an existing large file.
+ */
+void RandomOverwrite(struct phase *ph) {
+    int fd;
+    int pos;
+    int i;
+
+    BeginWorkload("rand");
+    fd = Create("/rand");
+    for (pos = 0; pos < file_size; pos += BLOCKSIZE) {
+        Write(fd, io_buf, BLOCKSIZE);
+    }
+
+    BeginPhase(ph, "overwrite");
+    for (i = 0; i < num_ops; i++) {
+        Seek(fd, rand() % (file_size - chunk_size + 1), SEEK_SET);
+        long long t0 = Now();
+        Record(ph, t0, Write(fd, io_buf, chunk_size) != chunk_size);
+    }
+    EndPhase(ph);
+
+    BeginPhase(ph, "read");
+    for (i = 0; i < num_ops; i++) {
+        Seek(fd, rand() % (file_size - chunk_size + 1), SEEK_SET);
+        long long t0 = Now();
+        Record(ph, t0, Read(fd, io_buf, chunk_size) != chunk_size);
+    }
+    EndPhase(ph);
+
+    SyncPhase(ph);
+    Close(fd);
+    Unlink("/rand");
+    EndWorkload();
+}
+
+/*
+ * One directory with many entries, looked up in random order.
+ */
+void DirectoryFanout(struct phase *ph) {
+    char name[NAME_LEN];
+    int i;
+    int fd;
+
+    BeginWorkload("fanout");
+    MkDir("/fan");
+
+    BeginPhase(ph, "create");
+    for (i = 0; i < num_files; i++) {
+        sprintf(name, "/fan/entry%04d", i);
+        long long t0 = Now();
+        fd = Create(name);
+        Record(ph, t0, fd < 0);
+        Close(fd);
+    }
+    EndPhase(ph);
+
+    BeginPhase(ph, "lookup");
+    for (i = 0; i < num_ops; i++) {
+        struct Stat sb;
+        sprintf(name, "/fan/entry%04d", rand() % num_files);
+        long long t0 = Now();
+        Record(ph, t0, Stat(name, &sb) < 0);
+    }
+    EndPhase(ph);
+
+    BeginPhase(ph, "miss");
+    for (i = 0; i < num_ops; i++) {
+        struct Stat sb;
+        sprintf(name, "/fan/none%04d", i);
+        long long t0 = Now();
+        Record(ph, t0, Stat(name, &sb) == 0);
+    }
+    EndPhase(ph);
+
+    BeginPhase(ph, "unlink");
+    for (i = 0; i < num_files; i++) {
+        sprintf(name, "/fan/entry%04d", i);
+        long long t0 = Now();
+        Record(ph, t0, Unlink(name) < 0);
+    }
+    EndPhase(ph);
+
+    SyncPhase(ph);
+    RmDir("/fan");
+    EndWorkload();
+}
+
+/*
+ * Lookups through nested directories, each after a sequential read of
+ * twice the block cache from a large file: a scan-resistant cache keeps
+ * the directory blocks, plain LRU reads them all back.
+ */
+void ScanMixed(struct phase *ph) {
+    char path[MAXPATHNAMELEN];
+    int scan_size = 2 * BLOCK_CACHESIZE * BLOCKSIZE;
+    int pos = 0;
+    int i;
+    int fd;
+
+    BeginWorkload("scan");
+    strcpy(path, "/scan");
+    MkDir(path);
+    for (i = 0; i < depth; i++) {
+        sprintf(path + strlen(path), "/d%d", i);
+        MkDir(path);
+    }
+    strcat(path, "/leaf");
+    fd = Create(path);
+    Close(fd);
+
+    if (scan_size > file_size) scan_size = file_size;
+    fd = Create("/scan/big");
+    Write(fd, io_buf, file_size);
+
+    BeginPhase(ph, "lookup");
+    for (i = 0; i < num_ops; i++) {
+        struct Stat sb;
+        long long t0 = Now();
+        Record(ph, t0, Stat(path, &sb) < 0);
+    }
+    EndPhase(ph);
+
+    BeginPhase(ph, "scan+lookup");
+    for (i = 0; i < num_ops / 16; i++) {
+        struct Stat sb;
+        if (pos + scan_size > file_size) pos = 0;
+        Seek(fd, pos, SEEK_SET);
+        long long t0 = Now();
+        int failed = Read(fd, io_buf, scan_size) != scan_size;
+        failed |= Stat(path, &sb) < 0;
+        Record(ph, t0, failed);
+        pos += scan_size;
+    }
+    EndPhase(ph);
+
+    Close(fd);
+    Unlink("/scan/big");
+    Unlink(path);
+    *strrchr(path, '/') = '\0';
+    for (i = 0; i < depth; i++) {
+        RmDir(path);
+        *strrchr(path, '/') = '\0';
+    }
+    RmDir("/scan");
+
+    SyncPhase(ph);
+    EndWorkload();
+}
+
+/*
+ * A few hot blocks read after each pass of a scan that reads twice the
+ * block cache chunk bytes at a time, so every scanned block is hit
+ * several times in a row.  Those hits are one use to a scan-resistant
+ * cache: the hot blocks should stay, and only the scan is read.  The
+ * hot blocks are read twice first, half a cache apart, so that 2Q has
+ * seen them come back.
+ */
+void ChunkedScan(struct phase *ph) {
+    int scan_size = 2 * BLOCK_CACHESIZE * BLOCKSIZE;
+    int hot_size = HOT_BLOCKS * BLOCKSIZE;
+    int pos = 0;
+    int done;
+    int i;
+
+    BeginWorkload("chunkscan");
+    MkDir("/chunkscan");
+    if (hot_size > file_size) hot_size = file_size;
+    int hot = Create("/chunkscan/hot");
+    Write(hot, io_buf, hot_size);
+    if (scan_size > file_size) scan_size = file_size;
+    int big = Create("/chunkscan/big");
+    Write(big, io_buf, file_size);
+
+    int warm_size = BLOCK_CACHESIZE / 2 * BLOCKSIZE;
+    if (warm_size > file_size) warm_size = file_size;
+    Seek(hot, 0, SEEK_SET);
+    Read(hot, io_buf, hot_size);
+    Seek(big, file_size - warm_size, SEEK_SET);
+    Read(big, io_buf, warm_size);
+    Seek(hot, 0, SEEK_SET);
+    Read(hot, io_buf, hot_size);
+
+    BeginPhase(ph, "scan+hot");
+    for (i = 0; i < num_ops / 16; i++) {
+        if (pos + scan_size > file_size) pos = 0;
+        Seek(big, pos, SEEK_SET);
+        long long t0 = Now();
+        int failed = 0;
+        for (done = 0; done < scan_size; done += chunk_size) {
+            int len = scan_size - done < chunk_size ? scan_size - done : chunk_size;
+            failed |= Read(big, io_buf, len) != len;
+        }
+        Seek(hot, 0, SEEK_SET);
+        failed |= Read(hot, io_buf, hot_size) != hot_size;
+        Record(ph, t0, failed);
+        pos += scan_size;
+    }
+    EndPhase(ph);
+
+    Close(hot);
+    Close(big);
+    Unlink("/chunkscan/hot");
+    Unlink("/chunkscan/big");
+    RmDir("/chunkscan");
+
+    SyncPhase(ph);
+    EndWorkload();
+}
+
+/*
+ * Files grown by interleaved appends on a disk aged by deleting every
+ * other small file, then read back sequentially: shows how contiguous
+ * the allocator keeps each file.
+ */
+void AgedAppends(struct phase *ph) {
+    char name[NAME_LEN];
+    int fds[AGED_FILES];
+    int pos;
+    int i;
+    int fd;
+
+    BeginWorkload("aged");
+    MkDir("/aged");
+    for (i = 0; i < num_files; i++) {
+        sprintf(name, "/aged/old%03d", i);
+        fd = Create(name);
+        Write(fd, io_buf, 2 * BLOCKSIZE);
+        Close(fd);
+    }
+    for (i = 0; i < num_files; i += 2) {
+        sprintf(name, "/aged/old%03d", i);
+        Unlink(name);
+    }
+    for (i = 0; i < AGED_FILES; i++) {
+        sprintf(name, "/aged/log%d", i);
+        fds[i] = Create(name);
+    }
+
+    BeginPhase(ph, "append");
+    for (pos = 0; pos < file_size / AGED_FILES; pos += chunk_size) {
+        for (i = 0; i < AGED_FILES; i++) {
+            long long t0 = Now();
+            Record(ph, t0, Write(fds[i], io_buf, chunk_size) != chunk_size);
+        }
+    }
+    EndPhase(ph);
+
+    SyncPhase(ph);
+
+    BeginPhase(ph, "read");
+    for (i = 0; i < AGED_FILES; i++) {
+        Seek(fds[i], 0, SEEK_SET);
+        for (pos = 0; pos < file_size / AGED_FILES; pos += chunk_size) {
+            long long t0 = Now();
+            Record(ph, t0, Read(fds[i], io_buf, chunk_size) != chunk_size);
+        }
+    }
+    EndPhase(ph);
+
+    for (i = 0; i < AGED_FILES; i++) {
+        Close(fds[i]);
+        sprintf(name, "/aged/log%d", i);
+        Unlink(name);
+    }
+    for (i = 1; i < num_files; i += 2) {
+        sprintf(name, "/aged/old%03d", i);
+        Unlink(name);
+    }
+    RmDir("/aged");
+
+    SyncPhase(ph);
+    EndWorkload();
+}
+
+/*
+ * One chunk written at the end of each of many empty files, then the
+ * first and last chunk read back: a file system that fills the gap
+ * allocates the whole file size per write.
+ */
+void SparseFiles(struct phase *ph) {
+    char name[NAME_LEN];
+    int i;
+    int fd;
+
+    BeginWorkload("sparse");
+    MkDir("/sparse");
+
+    BeginPhase(ph, "write");
+    for (i = 0; i < num_files; i++) {
+        sprintf(name, "/sparse/f%03d", i);
+        long long t0 = Now();
+        fd = Create(name);
+        Seek(fd, file_size - chunk_size, SEEK_SET);
+        Record(ph, t0, fd < 0 || Write(fd, io_buf, chunk_size) != chunk_size);
+        Close(fd);
+    }
+    EndPhase(ph);
+
+    SyncPhase(ph);
+
+    BeginPhase(ph, "read");
+    for (i = 0; i < num_files; i++) {
+        sprintf(name, "/sparse/f%03d", i);
+        fd = Open(name);
+        long long t0 = Now();
+        Record(ph, t0, Read(fd, io_buf, chunk_size) != chunk_size);
+        t0 = Now();
+        Seek(fd, file_size - chunk_size, SEEK_SET);
+        Record(ph, t0, Read(fd, io_buf, chunk_size) != chunk_size);
+        Close(fd);
+    }
+    EndPhase(ph);
+
+    for (i = 0; i < num_files; i++) {
+        sprintf(name, "/sparse/f%03d", i);
+        Unlink(name);
+    }
+    RmDir("/sparse");
+
+    SyncPhase(ph);
+    EndWorkload();
+}
+
+struct workload {
+    char *name;
+    void (*run)(struct phase *);
+};
+
+struct workload workloads[] = {
+    { "small", SmallFiles },
+    { "deep", DeepPaths },
+    { "seq", SequentialLarge },
+    { "bulk", BulkTransfer },
+    { "rand", RandomOverwrite },
+    { "fanout", DirectoryFanout },
+    { "scan", ScanMixed },
+    { "chunkscan", ChunkedScan },
+    { "aged", AgedAppends },
+    { "sparse", SparseFiles },
+};
+
+#define NUM_WORKLOADS   (int)(sizeof(workloads) / sizeof(workloads[0]))
+
+int main(int argc, char **argv) {
+    int seed = 421;
+    int opt;
+    int i;
+    int j;
+
+    while ((opt = getopt(argc, argv, "n:d:s:o:c:r:")) != -1) {
+        switch (opt) {
+            case 'n': num_files = atoi(optarg); break;
+            case 'd': depth = atoi(optarg); break;
+            case 's': file_size = atoi(optarg); break;
+            case 'o': num_ops = atoi(optarg); break;
+            case 'c': chunk_size = atoi(optarg); break;
+            case 'r': seed = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: yfsbench [-n files] [-d depth] [-s bytes] [-o ops] "
+                        "[-c chunk] [-r seed] [workload ...]\n");
+                Shutdown();
+                Exit(1);
+        }
+    }
+    if (num_ops > MAX_PHASE_OPS) num_ops = MAX_PHASE_OPS;
+    if (num_files > MAX_PHASE_OPS) num_files = MAX_PHASE_OPS;
+    if (chunk_size > file_size) chunk_size = file_size;
+
+    srand(seed);
+    io_buf = malloc(file_size > BLOCKSIZE ? file_size : BLOCKSIZE);
+    memset(io_buf, 'y', file_size > BLOCKSIZE ? file_size : BLOCKSIZE);
+    struct phase *ph = malloc(sizeof(struct phase));
+
+    printf("{\n  \"config\": {\"block_cachesize\": %d, \"inode_cachesize\": %d, "
+           "\"numsectors\": %d, \"files\": %d, \"depth\": %d, \"file_size\": %d, "
+           "\"ops\": %d, \"chunk\": %d, \"seed\": %d},\n  \"workloads\": [",
+           BLOCK_CACHESIZE, INODE_CACHESIZE, NUMSECTORS, num_files, depth,
+           file_size, num_ops, chunk_size, seed);
+
+    for (i = 0; i < NUM_WORKLOADS; i++) {
+        int selected = (optind == argc);
+        for (j = optind; j < argc; j++) {
+            if (strcmp(argv[j], workloads[i].name) == 0) selected = 1;
+        }
+        if (selected) {
+            workloads[i].run(ph);
+            fflush(stdout);
+        }
+    }
+    printf("\n  ]\n}\n");
+
+    free(ph);
+    free(io_buf);
+    Shutdown();
+    return 0;
+}
@@ -0,0 +1,219 @@
+/*
+ *  YFS request replay.
+ *
+ *  Feeds the requests recorded by "yfs -R file" to the server, in
+ *  the recorded order and as fast as it answers, and prints one JSON
+ *  document with the throughput, the sectors read and written, and
+ *  per message type the replayed p50/p99/mean latency next to the
+ *  recorded mean service time.  Run it against a server started on a
+ *  copy of the image the recording started from: every reply is then
+ *  compared with the recorded one, and those that differ are counted
+ *  as diverged.
+ *
+ *  Client pointers are replaced by buffers of this program's own:
+ *  names and pathnames hold the recorded bytes, and written data is
+ *  filler of the recorded length.  MSG_STATS and MSG_TRACE requests
+ *  are not replayed, nor is any whose name could not be recorded.
+ *  Flushes are, so the server should run with "-f 0".  A recorded
+ *  shutdown ends the replay, and the server is shut down at the end
+ *  either way.
+ *
+ *  Usage: yfsreplay record_file
+ *
+ *  This is a host program: for example
+ *
+ *      cp DISK DISK.orig && ./yfs-host -R app.rec app
+ *      cp DISK.orig DISK && ./yfs-host -f 0 host/bin/yfsreplay app.rec
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <comp421/yalnix.h>
+#include <comp421/iolib.h>
+#include <comp421/filesystem.h>
+#include "../packet.h"
+
+char *message_names[MSG_TYPES] = {
+    "get_file", "search", "create", "read", "write", "mkdir", "rmdir",
+    "link", "unlink", "sync", "stats", "flush", "resolve", "trace"
+};
+
+struct message_replay {
+    int ops;
+    int size;
+    long long *lat;
+    long long recorded_us;
+};
+
+struct message_replay replays[MSG_TYPES];
+
+/*
+ * Current monotonic time in nanoseconds.
+ */
+long long Now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Fetch the server counters.
+ */
+void GetServerStats(ServerStats *stats) {
+    DataPacket *packet = malloc(PACKET_SIZE);
+    memset(packet, 0, PACKET_SIZE);
+    memset(stats, 0, sizeof(ServerStats));
+    packet->packet_type = MSG_STATS;
+    packet->pointer = (void *)stats;
+    Send(packet, -FILE_SERVER);
+    free(packet);
+}
+
+int CompareLatency(const void *a, const void *b) {
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Nearest-rank percentile of sorted latencies, in microseconds.
+ */
+double Percentile(long long *lat, int n, double p) {
+    if (n == 0) {
+        return 0;
+    }
+    int rank = (int)(p * n + 0.999999);
+    if (rank < 1) rank = 1;
+    return lat[rank - 1] / 1000.0;
+}
+
+void NoteLatency(int type, long long lat, int recorded_us) {
+    struct message_replay *m = &replays[type];
+    if (m->ops == m->size) {
+        m->size = m->size == 0 ? 256 : m->size * 2;
+        m->lat = realloc(m->lat, m->size * sizeof(long long));
+    }
+    m->lat[m->ops++] = lat;
+    m->recorded_us += recorded_us;
+}
+
+/*
+ * Whether the replayed reply matches the recorded one.  Flush replies
+ * depend on the flusher's idle count, so only their type is compared.
+ */
+int SameReply(char *reply, char *recorded) {
+    if (((UnknownPacket *)recorded)->packet_type == MSG_FLUSH) {
+        return ((UnknownPacket *)reply)->packet_type == MSG_FLUSH;
+    }
+    return memcmp(reply, recorded, PACKET_SIZE) == 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: yfsreplay record_file\n");
+        Shutdown();
+        Exit(1);
+    }
+    FILE *file = fopen(argv[1], "rb");
+    if (file == NULL) {
+        perror(argv[1]);
+        Shutdown();
+        Exit(1);
+    }
+
+    RequestRecord record;
+    char *packet = malloc(PACKET_SIZE);
+    char *name = malloc(MAXPATHNAMELEN + 1);
+    int data_size = BLOCKSIZE;
+    char *data = malloc(data_size);
+    int records = 0;
+    int replayed = 0;
+    int skipped = 0;
+    int diverged = 0;
+    int i;
+
+    ServerStats before;
+    ServerStats after;
+    GetServerStats(&before);
+    long long start = Now();
+
+    while (fread(&record, sizeof(RequestRecord), 1, file) == 1) {
+        records++;
+        if (record.data_len > 0 &&
+            (record.data_len > MAXPATHNAMELEN || fread(name, 1, record.data_len, file) != (size_t)record.data_len)) {
+            fprintf(stderr, "yfsreplay: record %d is cut short\n", records);
+            break;
+        }
+
+        DataPacket *request = (DataPacket *)record.packet;
+        int type = request->packet_type;
+        if (type < 0 || type >= MSG_TYPES || type == MSG_STATS || type == MSG_TRACE ||
+            record.data_len < 0) {
+            skipped++;
+            continue;
+        }
+        if (type == MSG_SYNC && request->arg1 == 1) {
+            break;
+        }
+
+        memcpy(packet, record.packet, PACKET_SIZE);
+        if (record.data_len > 0) {
+            name[record.data_len] = '\0';
+            ((DataPacket *)packet)->pointer = (void *)name;
+        } else if (type == MSG_READ_FILE || type == MSG_WRITE_FILE) {
+            if (request->arg3 > data_size) {
+                data_size = request->arg3;
+                data = realloc(data, data_size);
+            }
+            memset(data, 'r', data_size);
+            ((DataPacket *)packet)->pointer = (void *)data;
+        }
+
+        long long t0 = Now();
+        Send(packet, -FILE_SERVER);
+        NoteLatency(type, Now() - t0, record.service_us);
+        replayed++;
+        if (!SameReply(packet, record.reply)) {
+            diverged++;
+        }
+    }
+    fclose(file);
+
+    double seconds = (Now() - start) / 1e9;
+    GetServerStats(&after);
+
+    printf("{\n  \"records\": %d, \"replayed\": %d, \"skipped\": %d, \"diverged\": %d, "
+           "\"seconds\": %.6f, \"ops_per_sec\": %.1f, \"sector_reads\": %d, \"sector_writes\": %d,\n"
+           "  \"messages\": [",
+           records, replayed, skipped, diverged, seconds, seconds > 0 ? replayed / seconds : 0,
+           after.sector_reads - before.sector_reads, after.sector_writes - before.sector_writes);
+    int first = 1;
+    for (i = 0; i < MSG_TYPES; i++) {
+        struct message_replay *m = &replays[i];
+        if (m->ops == 0) {
+            continue;
+        }
+        long long total = 0;
+        int k;
+        for (k = 0; k < m->ops; k++) {
+            total += m->lat[k];
+        }
+        qsort(m->lat, m->ops, sizeof(long long), CompareLatency);
+        printf("%s\n    {\"op\": \"%s\", \"ops\": %d, \"p50_us\": %.2f, \"p99_us\": %.2f, "
+               "\"mean_us\": %.2f, \"recorded_mean_us\": %.2f}",
+               first ? "" : ",", message_names[i], m->ops,
+               Percentile(m->lat, m->ops, 0.50), Percentile(m->lat, m->ops, 0.99),
+               total / 1000.0 / m->ops, (double)m->recorded_us / m->ops);
+        first = 0;
+        free(m->lat);
+    }
+    printf("\n  ]\n}\n");
+
+    free(packet);
+    free(name);
+    free(data);
+    Shutdown();
+    return 0;
+}
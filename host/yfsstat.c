@@ -0,0 +1,217 @@
+/*
+ *  YFS server statistics.
+ *
+ *  Polls the server with MSG_STATS and prints, for each interval,
+ *  the rate and mean service time of every message type (and its
+ *  largest so far), the block/inode/name cache hit ratios, evictions
+ *  and dirty write-backs, the sectors read and written, the bytes
+ *  moved by CopyFrom and CopyTo, and the free blocks and inodes.
+ *
+ *  Usage: yfsstat [-t ticks] [-n reports] [-o trace_file] [program [args]]
+ *
+ *  A program given after the options is forked and run as the load
+ *  while yfsstat watches.  Reports stop after -n of them, when the
+ *  server goes away, or after IDLE_REPORTS intervals with no other
+ *  requests.  Service times are only measured by servers built with
+ *  YFS_CLOCK.
+ *
+ *  With -o, each interval also drains the server's trace ring (see
+ *  "yfs -T") with MSG_TRACE and appends the events to trace_file, for
+ *  host/bin/yfstracedump.
+ *
+ *  This is a host program: run it as "./yfs-host host/bin/yfsstat".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <comp421/yalnix.h>
+#include <comp421/iolib.h>
+#include <comp421/filesystem.h>
+#include "../packet.h"
+
+#define IDLE_REPORTS    4
+#define TRACE_CHUNK     4096
+
+char *message_names[MSG_TYPES] = {
+    "get_file", "search", "create", "read", "write", "mkdir", "rmdir",
+    "link", "unlink", "sync", "stats", "flush", "resolve", "trace"
+};
+
+/*
+ * Current monotonic time in nanoseconds.
+ */
+long long Now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Fetch the server counters, or return -1 if the server is gone.
+ */
+int GetServerStats(ServerStats *stats) {
+    DataPacket *packet = malloc(PACKET_SIZE);
+    memset(packet, 0, PACKET_SIZE);
+    memset(stats, 0, sizeof(ServerStats));
+    packet->packet_type = MSG_STATS;
+    packet->pointer = (void *)stats;
+    int result = Send(packet, -FILE_SERVER);
+    if (result == 0 && packet->arg1 < 0) {
+        result = -1;
+    }
+    free(packet);
+    return result;
+}
+
+/*
+ * Move the server's undrained trace events to file.
+ */
+void DrainTrace(FILE *file) {
+    TraceEvent *events = malloc(TRACE_CHUNK * sizeof(TraceEvent));
+    DataPacket *packet = malloc(PACKET_SIZE);
+    do {
+        memset(packet, 0, PACKET_SIZE);
+        packet->packet_type = MSG_TRACE;
+        packet->arg1 = TRACE_CHUNK;
+        packet->pointer = (void *)events;
+        if (Send(packet, -FILE_SERVER) < 0 || packet->arg1 < 0) {
+            break;
+        }
+        if (packet->arg2 > 0) {
+            fprintf(stderr, "yfsstat: %d trace events lost\n", packet->arg2);
+        }
+        fwrite(events, sizeof(TraceEvent), packet->arg1, file);
+    } while (packet->arg1 == TRACE_CHUNK);
+    fflush(file);
+    free(packet);
+    free(events);
+}
+
+double Ratio(long long num, long long den) {
+    return den == 0 ? 0 : (double)num / den;
+}
+
+/*
+ * Print the changes between two snapshots taken seconds apart.
+ * Returns the requests served other than MSG_STATS.
+ */
+int Report(ServerStats *before, ServerStats *after, double seconds) {
+    int requests = 0;
+    int i;
+
+    printf("--- %.2fs: free %d blocks, %d inodes; caches %d blocks, %d inodes, %d names\n",
+           seconds, after->free_blocks, after->free_inodes, after->block_cache_entries,
+           after->inode_cache_entries, after->name_cache_entries);
+    printf("%-9s %9s %9s %9s %9s\n", "message", "count", "per_sec", "mean_us", "max_us");
+    for (i = 0; i < MSG_TYPES; i++) {
+        int count = after->messages[i].count - before->messages[i].count;
+        long long total = after->messages[i].total_us - before->messages[i].total_us;
+        if (count == 0) {
+            continue;
+        }
+        if (i != MSG_STATS && i != MSG_TRACE) {
+            requests += count;
+        }
+        printf("%-9s %9d %9.1f %9.1f %9d\n", message_names[i], count,
+               Ratio(count, 1) / seconds, Ratio(total, count), after->messages[i].max_us);
+    }
+    printf("after_reply_us %.0f\n", (double)(after->after_reply_us - before->after_reply_us));
+
+    int bhits = after->block_hits - before->block_hits;
+    int bmiss = after->block_misses - before->block_misses;
+    int ihits = after->inode_hits - before->inode_hits;
+    int imiss = after->inode_misses - before->inode_misses;
+    int nhits = after->name_hits - before->name_hits;
+    int nmiss = after->name_misses - before->name_misses;
+    printf("cache     hit_ratio  evict/s  writeback/s\n");
+    printf("block     %9.3f %8.1f %12.1f\n", Ratio(bhits, bhits + bmiss),
+           (after->block_evictions - before->block_evictions) / seconds,
+           (after->block_writebacks - before->block_writebacks) / seconds);
+    printf("inode     %9.3f %8.1f %12.1f\n", Ratio(ihits, ihits + imiss),
+           (after->inode_evictions - before->inode_evictions) / seconds,
+           (after->inode_writebacks - before->inode_writebacks) / seconds);
+    printf("name      %9.3f\n", Ratio(nhits, nhits + nmiss));
+    printf("sectors   read/s %.1f  write/s %.1f\n",
+           (after->sector_reads - before->sector_reads) / seconds,
+           (after->sector_writes - before->sector_writes) / seconds);
+    printf("copies    from KB/s %.1f  to KB/s %.1f\n",
+           (after->copy_from_bytes - before->copy_from_bytes) / 1024.0 / seconds,
+           (after->copy_to_bytes - before->copy_to_bytes) / 1024.0 / seconds);
+    fflush(stdout);
+    return requests;
+}
+
+int main(int argc, char **argv) {
+    int ticks = 10;
+    int reports = 0;
+    FILE *trace = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "+t:n:o:")) != -1) {
+        switch (opt) {
+            case 't': ticks = atoi(optarg); break;
+            case 'n': reports = atoi(optarg); break;
+            case 'o':
+                if ((trace = fopen(optarg, "wb")) == NULL) {
+                    perror(optarg);
+                    Exit(1);
+                }
+                break;
+            default:
+                fprintf(stderr, "usage: yfsstat [-t ticks] [-n reports] [-o trace_file] [program [args]]\n");
+                Exit(1);
+        }
+    }
+    if (ticks < 1) ticks = 1;
+
+    if (optind < argc) {
+        int pid = Fork();
+        if (pid == 0) {
+            Exec(argv[optind], argv + optind);
+            fprintf(stderr, "yfsstat: cannot exec %s\n", argv[optind]);
+            Exit(1);
+        }
+        if (pid < 0) {
+            fprintf(stderr, "yfsstat: cannot fork\n");
+            Exit(1);
+        }
+    }
+
+    ServerStats *before = malloc(sizeof(ServerStats));
+    ServerStats *after = malloc(sizeof(ServerStats));
+    if (GetServerStats(before) < 0) {
+        fprintf(stderr, "yfsstat: no server\n");
+        Exit(1);
+    }
+    long long then = Now();
+    int idle = 0;
+    int done = 0;
+
+    while (reports == 0 || done < reports) {
+        Delay(ticks);
+        if (trace != NULL) {
+            DrainTrace(trace);
+        }
+        if (GetServerStats(after) < 0) {
+            break;
+        }
+        long long now = Now();
+        idle = Report(before, after, (now - then) / 1e9) == 0 ? idle + 1 : 0;
+        if (idle >= IDLE_REPORTS) {
+            break;
+        }
+        memcpy(before, after, sizeof(ServerStats));
+        then = now;
+        done++;
+    }
+
+    if (trace != NULL) {
+        fclose(trace);
+    }
+    free(before);
+    free(after);
+    return 0;
+}
@@ -0,0 +1,228 @@
+/*
+ *  Offline decoder for YFS trace events.
+ *
+ *  Reads the TraceEvent records written by "yfs -T file" at shutdown
+ *  and by "yfsstat -o file", in the order given, and prints a summary
+ *  per message type of where the server's time went, a timeline of
+ *  every request (-t), or folded stacks for flame graph tools (-f).
+ *
+ *  The time between two events is charged to what the first one
+ *  started: disk_read after a sector read, disk_write after a sector
+ *  write, and cpu otherwise.  Stacks are "message;phase;activity",
+ *  the phase being request (receipt to reply) or after_reply
+ *  (read-ahead and write-back once the client is released).  Traces
+ *  from servers built without YFS_CLOCK have no times, only counts.
+ *
+ *  Usage: yfstracedump [-t | -f] file ...
+ *
+ *  This is an ordinary Linux program, not a Yalnix one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../packet.h"
+
+#define PHASE_IDLE      -1
+#define PHASE_REQUEST   0
+#define PHASE_AFTER     1
+#define PHASES          2
+
+#define ACT_CPU         0
+#define ACT_DISK_READ   1
+#define ACT_DISK_WRITE  2
+#define ACTIVITIES      3
+
+char *message_names[MSG_TYPES] = {
+    "get_file", "search", "create", "read", "write", "mkdir", "rmdir",
+    "link", "unlink", "sync", "stats", "flush", "resolve", "trace"
+};
+
+char *kind_names[TRACE_KINDS] = {
+    "start", "reply", "done", "block_hit", "block_miss", "block_evict",
+    "inode_hit", "inode_miss", "inode_evict", "sector_read", "sector_write"
+};
+
+char *phase_names[PHASES] = {"request", "after_reply"};
+char *activity_names[ACTIVITIES] = {"cpu", "disk_read", "disk_write"};
+
+struct message_summary {
+    long long count;
+    long long time[PHASES][ACTIVITIES];
+    long long events[TRACE_KINDS];
+};
+
+struct message_summary summary[MSG_TYPES];
+
+/*
+ * What the time after an event of this kind is spent on.
+ */
+int Activity(int kind) {
+    if (kind == TRACE_SECTOR_READ) return ACT_DISK_READ;
+    if (kind == TRACE_SECTOR_WRITE) return ACT_DISK_WRITE;
+    return ACT_CPU;
+}
+
+/*
+ * Read every event of the files, in order.
+ */
+TraceEvent *LoadEvents(char **files, int num_files, long *count) {
+    TraceEvent *events = NULL;
+    long size = 0;
+    int i;
+
+    *count = 0;
+    for (i = 0; i < num_files; i++) {
+        FILE *file = fopen(files[i], "rb");
+        if (file == NULL) {
+            perror(files[i]);
+            exit(1);
+        }
+        while (1) {
+            if (*count == size) {
+                size = size == 0 ? 65536 : size * 2;
+                events = realloc(events, size * sizeof(TraceEvent));
+            }
+            if (fread(&events[*count], sizeof(TraceEvent), 1, file) != 1) {
+                break;
+            }
+            (*count)++;
+        }
+        fclose(file);
+    }
+    return events;
+}
+
+void PrintSummary() {
+    int i;
+    int p;
+    int a;
+
+    printf("%-9s %8s %11s %11s %7s %7s %7s %8s %8s %8s\n", "message", "count",
+           "request_us", "after_us", "cpu%", "read%", "write%",
+           "reads", "writes", "misses");
+    for (i = 0; i < MSG_TYPES; i++) {
+        struct message_summary *m = &summary[i];
+        if (m->count == 0) {
+            continue;
+        }
+        long long phase_total[PHASES] = {0, 0};
+        long long activity_total[ACTIVITIES] = {0, 0, 0};
+        long long total = 0;
+        for (p = 0; p < PHASES; p++) {
+            for (a = 0; a < ACTIVITIES; a++) {
+                phase_total[p] += m->time[p][a];
+                activity_total[a] += m->time[p][a];
+                total += m->time[p][a];
+            }
+        }
+        printf("%-9s %8lld %11.1f %11.1f %7.1f %7.1f %7.1f %8.2f %8.2f %8.2f\n",
+               message_names[i], m->count,
+               (double)phase_total[PHASE_REQUEST] / m->count,
+               (double)phase_total[PHASE_AFTER] / m->count,
+               total == 0 ? 0 : 100.0 * activity_total[ACT_CPU] / total,
+               total == 0 ? 0 : 100.0 * activity_total[ACT_DISK_READ] / total,
+               total == 0 ? 0 : 100.0 * activity_total[ACT_DISK_WRITE] / total,
+               (double)m->events[TRACE_SECTOR_READ] / m->count,
+               (double)m->events[TRACE_SECTOR_WRITE] / m->count,
+               (double)(m->events[TRACE_BLOCK_MISS] + m->events[TRACE_INODE_MISS]) / m->count);
+    }
+    printf("\nrequest_us and after_us are means per request; reads, writes and\n"
+           "misses (block and inode) are per request, both phases together.\n");
+}
+
+void PrintFolded() {
+    int i;
+    int p;
+    int a;
+
+    for (i = 0; i < MSG_TYPES; i++) {
+        for (p = 0; p < PHASES; p++) {
+            for (a = 0; a < ACTIVITIES; a++) {
+                if (summary[i].time[p][a] > 0) {
+                    printf("%s;%s;%s %lld\n", message_names[i], phase_names[p],
+                           activity_names[a], summary[i].time[p][a]);
+                }
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    int timeline = 0;
+    int folded = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "tf")) != -1) {
+        switch (opt) {
+            case 't': timeline = 1; break;
+            case 'f': folded = 1; break;
+            default:
+                fprintf(stderr, "usage: yfstracedump [-t | -f] file ...\n");
+                return 1;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "usage: yfstracedump [-t | -f] file ...\n");
+        return 1;
+    }
+
+    long count;
+    TraceEvent *events = LoadEvents(argv + optind, argc - optind, &count);
+    int phase = PHASE_IDLE;
+    int type = 0;
+    unsigned int start = 0;
+    long i;
+
+    for (i = 0; i < count; i++) {
+        TraceEvent *event = &events[i];
+        if (event->kind < 0 || event->kind >= TRACE_KINDS) {
+            fprintf(stderr, "yfstracedump: bad event %ld\n", i);
+            return 1;
+        }
+
+        if (phase != PHASE_IDLE) {
+            TraceEvent *prev = &events[i - 1];
+            summary[type].time[phase][Activity(prev->kind)] += event->time_us - prev->time_us;
+        }
+
+        if (event->kind == TRACE_REQUEST_START) {
+            phase = PHASE_REQUEST;
+            type = event->aux >= 0 && event->aux < MSG_TYPES ? event->aux : 0;
+            start = event->time_us;
+            summary[type].count++;
+            if (timeline) {
+                printf("%s%10u  %s from pid %d\n", i > 0 ? "\n" : "", start,
+                       message_names[type], event->value);
+            }
+            continue;
+        }
+        if (event->kind == TRACE_REQUEST_END) {
+            phase = PHASE_AFTER;
+        }
+        if (phase == PHASE_IDLE) {
+            continue;
+        }
+        summary[type].events[event->kind]++;
+        if (timeline) {
+            if (event->kind == TRACE_REQUEST_END || event->kind == TRACE_AFTER_REPLY_END) {
+                printf("    +%8u  %s\n", event->time_us - start, kind_names[event->kind]);
+            } else {
+                printf("    +%8u  %s %d%s\n", event->time_us - start, kind_names[event->kind],
+                       event->value, event->aux ? " (dirty)" : "");
+            }
+        }
+        if (event->kind == TRACE_AFTER_REPLY_END) {
+            phase = PHASE_IDLE;
+        }
+    }
+
+    if (folded) {
+        PrintFolded();
+    } else if (!timeline) {
+        PrintSummary();
+    }
+    free(events);
+    return 0;
+}
@@ -10,33 +10,15 @@
  * PATH HANDLING *
  *****************/
 
-typedef struct PathIterator {
-    struct PathIterator *head;
-    struct PathIterator *next;
-    char data[DIRNAMELEN];
-} PathIterator;
-
 /*
  * Fill target buffer.
  */
 void SetDirectoryName(char *target, char *path, int start, int end);
 
 /*
- * Parse path into linked list.
+ * Fill filename with the last component of pathname, "." if it ends in '/'.
  */
-PathIterator *ParsePath(char *pathname);
-
-/*
- * Free PathIterator linked list.
- */
-int DeletePathIterator(PathIterator *it);
-
-PathIterator *CreatePathIterator(PathIterator *head) {
-    PathIterator *it = malloc(sizeof(PathIterator));
-    it->head = head;
-    it->next = NULL;
-    return it;
-}
+void LastComponent(char *pathname, char *filename);
 
 /*
  * Fill target buffer.
@@ -53,63 +35,20 @@ PathIterator *CreatePathIterator(PathIterator *head) {
  }
 
 /*
- * Parse pathname into linked list.
+ * Fill filename with the last component of pathname, "." if it ends in '/'.
  */
-PathIterator *ParsePath(char *pathname) {
-    PathIterator *it = CreatePathIterator(NULL);
-    PathIterator *head = it;
-
-    int i = 0;
-    int start = 0;
-    int found = 0;
-    char next;
-
-    if (pathname[0] == '/') {
-        SetDirectoryName(it->data, pathname, 0, 1);
-        it->next = CreatePathIterator(head);
-        it = it->next;
-        i++;
-        start = 1;
-        found = 1;
-    }
-
-    while ((next = pathname[i]) != '\0') {
-        if (found == 0 && next == '/') {
-            SetDirectoryName(it->data, pathname, start, i);
-            it->next = CreatePathIterator(head);
-            it = it->next;
-            found = 1;
-        } else if (found == 1 && next != '/') {
-            found = 0;
-            start = i;
-        }
-        i++;
+void LastComponent(char *pathname, char *filename) {
+    int end = strlen(pathname);
+    int start = end;
+    while (start > 0 && pathname[start - 1] != '/') {
+        start--;
     }
 
-    if (found) {
-        SetDirectoryName(it->data, ".", 0, 1);
-        it->next = CreatePathIterator(head);
+    if (start == end) {
+        SetDirectoryName(filename, ".", 0, 1);
     } else {
-        SetDirectoryName(it->data, pathname, start, i);
-        it->next = CreatePathIterator(head);
-    }
-
-    return head;
-}
-
-/*
- * Free PathIterator linked list.
- */
-int DeletePathIterator(PathIterator *head) {
-    PathIterator *prev;
-    PathIterator *it = head;
-
-    while (it != NULL) {
-        prev = it;
-        it = it->next;
-        free(prev);
+        SetDirectoryName(filename, pathname, start, end);
     }
-    return 0;
 }
 
 
@@ -213,61 +152,40 @@ FileDescriptor *GetFileDescriptor(int fd_id) {
 
 int current_inum = ROOTINODE;
 
+/*
+ * Resolve pathname on the server in one round trip.  Returns 0 if it
+ * exists, -1 if only its last component is missing and -2 otherwise.
+ */
 int IterateFilePath(char *pathname, int *parent_inum, struct Stat *stat, char *filename, int *reuse) {
-    void *packet = malloc(PACKET_SIZE);
-    ((DataPacket *)packet)->packet_type = MSG_SEARCH_FILE;
-    int next_inum = current_inum;
-    char *data;
-
-    *parent_inum = current_inum;
-    PathIterator *it = ParsePath(pathname);
-    while (it->next != NULL) {
-        data = it->data;
-        if (data[0] != '/') {
-            ((DataPacket *)packet)->arg1 = next_inum;
-            ((DataPacket *)packet)->pointer = (void *)data;
-            Send(packet, -FILE_SERVER);
-            *parent_inum = next_inum;
-            next_inum = ((FilePacket *)packet)->inum;
-        } else {
-            next_inum = ROOTINODE;
-            *parent_inum = ROOTINODE;
-        }
-        it = it->next;
+    PathPacket *packet = malloc(PACKET_SIZE);
+    memset(packet, 0, PACKET_SIZE);
+    ((DataPacket *)packet)->packet_type = MSG_RESOLVE_PATH;
+    ((DataPacket *)packet)->arg1 = current_inum;
+    ((DataPacket *)packet)->arg2 = strlen(pathname);
+    ((DataPacket *)packet)->pointer = (void *)pathname;
 
-        if (next_inum == 0) {
-            break;
-        }
+    int result = -2;
+    if (Send(packet, -FILE_SERVER) == 0) {
+        result = packet->status;
     }
 
-    int last_not_found = 0;
-    if (it->next == NULL && filename) {
-        memcpy(filename, data, DIRNAMELEN);
-    }
-    if (it->next == NULL && next_inum == 0) {
-        last_not_found = 1;
+    *parent_inum = packet->parent_inum;
+    if (filename) {
+        LastComponent(pathname, filename);
     }
 
-    if (next_inum != 0 && stat) {
-        stat->inum = ((FilePacket *)packet)->inum;
-        stat->type = ((FilePacket *)packet)->type;
-        stat->size = ((FilePacket *)packet)->size;
-        stat->nlink = ((FilePacket *)packet)->nlink;
+    if (result == 0 && stat) {
+        stat->inum = packet->inum;
+        stat->type = packet->type;
+        stat->size = packet->size;
+        stat->nlink = packet->nlink;
     }
-    if (next_inum != 0 && reuse) {
-        *reuse = ((FilePacket *)packet)->reuse;
+    if (result == 0 && reuse) {
+        *reuse = packet->reuse;
     }
 
-    DeletePathIterator(it);
     free(packet);
-
-    if (next_inum != 0) {
-        return 0;
-    }
-    if (last_not_found != 0) {
-        return -1;
-    }
-    return -2;
+    return result;
 }
 
 /**
@@ -629,6 +547,9 @@ int Link(char *oldname, char *newname) {
         else if (result == -4) {
             fprintf(stderr, "[Error] Not enough block left.\n");
         }
+        else if (result == -5) {
+            fprintf(stderr, "[Error] Directory has reached max size limit.\n");
+        }
         return -1;
     }
 
@@ -646,9 +567,10 @@ int Unlink(char *pathname) {
         return -1;
     }
 
+    char filename[DIRNAMELEN];
     int *parent_inum = malloc(sizeof(int));
     struct Stat *stat = malloc(sizeof(struct Stat));
-    int result = IterateFilePath(pathname, parent_inum, stat, NULL, NULL);
+    int result = IterateFilePath(pathname, parent_inum, stat, filename, NULL);
 
     if (result < 0) {
         fprintf(stderr, "[Error] Path not found\n");
@@ -668,6 +590,7 @@ int Unlink(char *pathname) {
     packet->packet_type = MSG_UNLINK;
     packet->arg1 = stat->inum;
     packet->arg2 = *parent_inum;
+    packet->pointer = (void *)filename;
     Send(packet, -FILE_SERVER);
     result = packet->arg1;
     free(parent_inum);
@@ -724,7 +647,7 @@ int MkDir(char *pathname) {
     free(parent_inum);
     free(stat);
 
-    if (new_inum == 0) {
+    if (new_inum <= 0) {
         fprintf(stderr, "[Error] File creation error\n");
         return -1;
     }
@@ -773,6 +696,7 @@ int RmDir(char *pathname) {
     packet->packet_type = MSG_DELETE_DIR;
     packet->arg1 = stat->inum;
     packet->arg2 = *parent_inum;
+    packet->pointer = (void *)filename;
     Send(packet, -FILE_SERVER);
     result = packet->arg1;
 
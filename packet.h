@@ -20,6 +20,16 @@
 
 #define MSG_SYNC 9
 
+#define MSG_STATS 10
+
+#define MSG_FLUSH 11
+
+#define MSG_RESOLVE_PATH 12
+
+#define MSG_TRACE 13
+
+#define MSG_TYPES 14
+
 typedef struct UnknownPacket {
   short packet_type;
   char name[30];
@@ -36,6 +46,22 @@ typedef struct FilePacket {
   int reuse;
 } FilePacket;
 
+/*
+ * Reply to MSG_RESOLVE_PATH.  status is 0 if the path was found, -1 if
+ * only its last component is missing, and -2 otherwise.
+ */
+typedef struct PathPacket {
+  short packet_type;
+  short status;
+
+  int parent_inum;
+  int inum;
+  int type;
+  int size;
+  int nlink;
+  int reuse;
+} PathPacket;
+
 typedef struct DataPacket {
   short packet_type; 
   char unused[6];
@@ -45,3 +71,100 @@ typedef struct DataPacket {
   int arg4; 
   void *pointer;
 } DataPacket;
+
+/*
+ * Requests of one message type and the time the server spent on them,
+ * from Receive to Reply.  Times are in microseconds, and stay 0 on
+ * servers built without a clock.
+ */
+typedef struct MessageStats {
+  int count;
+  int max_us;
+  long long total_us;
+} MessageStats;
+
+/*
+ * Server counters copied back to the client on MSG_STATS.
+ */
+typedef struct ServerStats {
+  int block_hits;
+  int block_misses;
+  int inode_hits;
+  int inode_misses;
+  int sector_reads;
+  int sector_writes;
+  int readahead_reads;
+  int readahead_hits;
+  int readahead_wasted;
+  int name_hits;
+  int name_misses;
+  int alloc_blocks;        /* blocks handed out by the allocator */
+  int alloc_runs;          /* of those, ones not placed at the caller's goal */
+  int read_seek_distance;  /* sectors the head moved to reach cache reads */
+  int map_hits;            /* file block lookups answered by an inode's block map */
+  int map_misses;          /* ones that had to look in an index block */
+  int block_cache_entries; /* current size of each cache, which a budget moves */
+  int inode_cache_entries;
+  int name_cache_entries;
+  int block_ghost_hits;    /* misses on something the cache evicted recently */
+  int inode_ghost_hits;
+  int name_ghost_hits;
+  int cache_resizes;       /* times the budget was moved between caches */
+  int block_evictions;     /* cached blocks replaced by others */
+  int inode_evictions;
+  int block_writebacks;    /* dirty blocks written back */
+  int inode_writebacks;    /* inode-table sectors written back */
+  int free_blocks;         /* as of the MSG_STATS request */
+  int free_inodes;
+  long long copy_from_bytes;  /* client data moved by CopyFrom */
+  long long copy_to_bytes;    /* and by CopyTo */
+  long long after_reply_us;   /* read-ahead and write-back done after replies */
+  MessageStats messages[MSG_TYPES];
+} ServerStats;
+
+/*
+ * Trace event kinds.  Request events carry the packet type in aux and
+ * the client pid in value; the others carry a block, inode or sector
+ * number in value, and evictions set aux if the victim was dirty.
+ */
+#define TRACE_REQUEST_START   0
+#define TRACE_REQUEST_END     1  /* reply sent */
+#define TRACE_AFTER_REPLY_END 2  /* read-ahead and write-back done */
+#define TRACE_BLOCK_HIT       3
+#define TRACE_BLOCK_MISS      4
+#define TRACE_BLOCK_EVICT     5
+#define TRACE_INODE_HIT       6
+#define TRACE_INODE_MISS      7
+#define TRACE_INODE_EVICT     8
+#define TRACE_SECTOR_READ     9  /* transfer about to start */
+#define TRACE_SECTOR_WRITE    10
+#define TRACE_KINDS           11
+
+/*
+ * One event of the server's trace ring, drained oldest first by
+ * MSG_TRACE (pointer to room for arg1 events; the reply's arg1 is the
+ * number copied and arg2 the number overwritten before they could
+ * be).  time_us is the low bits of a microsecond clock, 0 on servers
+ * built without one.
+ */
+typedef struct TraceEvent {
+  unsigned int time_us;
+  short kind;
+  short aux;
+  int value;
+} TraceEvent;
+
+/*
+ * One request of a recording made with "yfs -R file": the packet as
+ * received and as replied, followed by data_len bytes the server
+ * fetched from the client with CopyFrom (the name or pathname; file
+ * data is not kept, its length is in the packet).  data_len is -1 if
+ * that copy failed.
+ */
+typedef struct RequestRecord {
+  int pid;
+  int data_len;
+  int service_us;   /* receipt to reply, 0 on servers without a clock */
+  char packet[PACKET_SIZE];
+  char reply[PACKET_SIZE];
+} RequestRecord;
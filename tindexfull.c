@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <comp421/yalnix.h>
+#include <comp421/iolib.h>
+#include <comp421/filesystem.h>
+
+/*
+ * Fill an indexed directory past what its 255 buckets hold, so later
+ * entries go to overflow blocks, then check that every name can be
+ * found, that every other one can be unlinked and created again, and
+ * that none of the unlinked ones can be found in between.  Run it on a
+ * server started with -i, on a disk made with enough inodes (mkyfs
+ * 5100, say).
+ */
+
+#define NAMES	5000
+
+int
+main()
+{
+	char name[MAXPATHNAMELEN];
+	struct Stat sb;
+	int num_created = 0;
+	int bad = 0;
+	int i;
+
+	if (MkDir("/full") < 0) {
+		printf("tindexfull: cannot make /full\n");
+		Shutdown();
+	}
+
+	for (i = 0; i < NAMES; i++) {
+		sprintf(name, "/full/entry%d", i);
+		int fd = Create(name);
+		if (fd >= 0) {
+			num_created++;
+			Close(fd);
+		}
+	}
+
+	for (i = 0; i < NAMES; i++) {
+		sprintf(name, "/full/entry%d", i);
+		if (Stat(name, &sb) < 0) {
+			bad++;
+		}
+	}
+
+	for (i = 0; i < NAMES; i += 2) {
+		sprintf(name, "/full/entry%d", i);
+		if (Unlink(name) < 0) {
+			bad++;
+		}
+	}
+	for (i = 0; i < NAMES; i++) {
+		sprintf(name, "/full/entry%d", i);
+		if ((Stat(name, &sb) == 0) != (i % 2 == 1)) {
+			bad++;
+		}
+	}
+
+	for (i = 0; i < NAMES; i += 2) {
+		sprintf(name, "/full/entry%d", i);
+		int fd = Create(name);
+		if (fd < 0) {
+			bad++;
+		} else {
+			Close(fd);
+		}
+	}
+	for (i = 0; i < NAMES; i++) {
+		sprintf(name, "/full/entry%d", i);
+		if (Stat(name, &sb) < 0) {
+			bad++;
+		}
+	}
+
+	if (Stat("/full/..", &sb) < 0 || sb.inum != ROOTINODE) {
+		bad++;
+	}
+	Stat("/full", &sb);
+
+	printf("tindexfull: created %d of %d, %d blocks, %d bad\n",
+	    num_created, NAMES, sb.size / BLOCKSIZE, bad);
+	printf("%s\n", bad == 0 && num_created == NAMES ? "PASS" : "FAIL");
+
+	Shutdown();
+}
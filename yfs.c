@@ -4,19 +4,63 @@
 #include <string.h>
 #include <assert.h>
 #include <math.h>
+#ifdef YFS_CLOCK
+#include <time.h>
+#endif
 #include <comp421/yalnix.h>
 #include <comp421/filesystem.h>
 #include "yfs.h"
 #include "packet.h"
 
 #define DIRSIZE             (int)sizeof(struct dir_entry)
-#define MAX_DIRECT_SIZE     BLOCKSIZE * NUM_DIRECT
-#define MAX_INDIRECT_SIZE   BLOCKSIZE * (BLOCKSIZE / sizeof(int))
-#define MAX_FILE_SIZE       (int)(MAX_DIRECT_SIZE + MAX_INDIRECT_SIZE)
+#define PTRS_PER_BLOCK      (int)(BLOCKSIZE / sizeof(int))
+#define DOUBLE_SLOT         (PTRS_PER_BLOCK - 1)
+#define MAX_FILE_BLOCKS     (NUM_DIRECT + PTRS_PER_BLOCK + PTRS_PER_BLOCK * PTRS_PER_BLOCK)
 #define INODE_PER_BLOCK     (BLOCKSIZE / INODESIZE)
+#define INODE_BLOCK(inum)   ((inum) / INODE_PER_BLOCK + 1)
 #define DIR_PER_BLOCK       (BLOCKSIZE / DIRSIZE)
 #define GET_DIR_COUNT(n)    (n / DIRSIZE)
 
+#define CACHE_LRU           0
+#define CACHE_2Q            1
+#define PROBATION_SIZE      (cache_for_blocks->stack_size / 4)
+
+#define READAHEAD_LIMIT     32
+#define READAHEAD_MAX       (PROBATION_SIZE / 2 < READAHEAD_LIMIT ? PROBATION_SIZE / 2 : READAHEAD_LIMIT)
+
+#define NAME_CACHESIZE      64
+#define NAME_CACHE_MIN      16
+#define INODE_CACHE_ENTRIES (INODE_CACHESIZE * INODE_PER_BLOCK)
+
+#define BLOCK_SHARE         80 //Percent of a cache budget first given to blocks
+#define INODE_SHARE         15
+#define ADAPT_INTERVAL      256 //Requests between looks at the ghost lists
+#define ADAPT_STEPS         16 //A move shifts this fraction of the budget
+#define ADAPT_MIN_HITS      8 //Ghost hits needed before capacity moves
+#define BLOCK_ENTRY_BYTES   (int)(sizeof(struct block_cache_entry) + SECTORSIZE)
+#define INODE_ENTRY_BYTES   (int)(sizeof(struct inode_cache_entry) + sizeof(struct inode))
+#define NAME_ENTRY_BYTES    (int)sizeof(struct name_cache_entry)
+
+#define INDEX_ENTRY         2
+#define INDEX_MAGIC         "\0index"
+#define INDEX_MAGIC_LEN     6
+#define INDEX_DEPTH_MAX     8
+#define INDEX_BUCKETS_MAX   255
+
+#define ALLOC_RUN           8
+#define ALLOC_RUN_MAX       64
+#define DELAYED_MAX         (cache_for_blocks->stack_size / 4)
+#define DELAYED_BLOCK       -2 //Block number of a slot holding a delayed file block
+#define STAGING_SIZE        (64 * 1024)
+
+#define TRACE_EVENTS        65536 //Events held by the trace ring
+
+#define FLUSH_TICKS         5
+#define FLUSH_IDLE_LIMIT    4
+#define DIRTY_HIGH          (cache_for_blocks->stack_size / 2)
+#define DIRTY_LOW           (cache_for_blocks->stack_size / 4)
+#define USAGE               "Usage: yfs [-c lru|2q] [-f flush_ticks] [-i] [-m cache_kbytes] [-T trace_file] [-R record_file] program [args]\n"
+
 /******************
  * INTEGER BUFFER *
  ******************/
@@ -30,14 +74,52 @@ struct integer_buf {
     int full;
 };
 
-struct fs_header *file_system_header; 
+struct fs_header *file_system_header; //Whole first inode-table block, kept current
 
 struct integer_buf* free_inode_list;
-struct integer_buf* free_block_list; 
 
 struct block_cache* cache_for_blocks; 
 struct inode_cache* cache_for_inodes; 
 
+ServerStats server_stats;
+
+int flush_ticks = FLUSH_TICKS; //Delay between background flushes, 0 for none
+int flusher_pid = 0; //Running flusher process, or 0
+int requests_since_flush = 0;
+int idle_flushes = 0;
+int index_directories = 0; //Give directories a hashed index once they outgrow one block
+int cache_budget = 0; //Bytes shared by the three caches, 0 for the fixed sizes
+int requests_since_adapt = 0;
+
+TraceEvent *trace_ring = NULL; //Last TRACE_EVENTS events, NULL while tracing is off
+char *trace_file = NULL; //Where undrained events are written at shutdown
+int trace_next = 0; //Ring slot of the next event
+int trace_count = 0; //Events in the ring not drained yet
+int trace_lost = 0; //Events overwritten before they were drained
+
+FILE *record_file = NULL; //Every request is appended here, NULL while not recording
+RequestRecord request_record; //Request being handled while recording
+char record_data[MAXPATHNAMELEN]; //Its name or pathname, as the client sent it
+
+unsigned char *block_bitmap = NULL; //In-use bit per block, the block allocator's map
+unsigned char *reserve_bitmap = NULL; //Free blocks held back for some file's appends
+unsigned char *inode_bitmap = NULL; //In-use bit per inode, NULL on images without bitmaps
+int bitmaps_on_disk = 0; //Whether the image has room for the bitmaps
+int first_data_block; //First allocatable block
+int data_block_end; //First block past the allocatable ones
+int free_block_count = 0;
+int delayed_count = 0; //Cache slots holding file blocks not given disk blocks yet
+int dirty_block_count = 0; //Block cache slots changed since they were last written
+int dirty_inode_count = 0; //Cached inodes changed since they were last written
+int alloc_cursor; //Where allocations with no goal start looking
+int disk_head = 0; //Sector of the last transfer, for seek accounting
+int bitmaps_dirty = 0;
+int header_clean = 0; //Whether the header on disk says the bitmaps are current
+int header_dirty = 0; //Whether the header changed since block 1 was written
+int double_indirect = 0; //Whether the indirect block's last slot names a double-indirect block
+int indirect_span = PTRS_PER_BLOCK; //Data block pointers in the indirect block
+int max_file_size = (NUM_DIRECT + PTRS_PER_BLOCK) * BLOCKSIZE;
+
 
 /**
  * Buffer constructor.
@@ -54,6 +136,11 @@ void PushToBuffer(struct integer_buf *buf, int i);
  */
 int PopFromBuffer(struct integer_buf *buf);
 
+/**
+ * Number of values in buffer.
+ */
+int BufferCount(struct integer_buf *buf);
+
 /*
  * Fill target buffer.
  */
@@ -115,6 +202,16 @@ int PopFromBuffer(struct integer_buf *buf) {
     return next;
 }
 
+/**
+ * Number of values in buffer.
+ */
+int BufferCount(struct integer_buf *buf) {
+    if (buf->full) {
+        return buf->size;
+    }
+    return (buf->in - buf->out + buf->size) % buf->size;
+}
+
 /*
  * Fill target buffer.
  */
@@ -129,172 +226,475 @@ int PopFromBuffer(struct integer_buf *buf) {
      }
  }
 
+/*****************
+ * Client copies *
+ *****************/
+
+/**
+ * CopyFrom, counting the bytes moved.
+ */
+int CopyFromClient(int pid, void *dest, void *src, int len) {
+    int result = CopyFrom(pid, dest, src, len);
+    if (result >= 0) {
+        server_stats.copy_from_bytes += len;
+    }
+    return result;
+}
+
+/**
+ * CopyTo, counting the bytes moved.
+ */
+int CopyToClient(int pid, void *dest, void *src, int len) {
+    int result = CopyTo(pid, dest, src, len);
+    if (result >= 0) {
+        server_stats.copy_to_bytes += len;
+    }
+    return result;
+}
+
+/**
+ * Monotonic time in microseconds, or 0 on servers built without
+ * YFS_CLOCK: Yalnix has no clock call, so only host builds time
+ * requests.
+ */
+long long ServiceClock() {
+#ifdef YFS_CLOCK
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+#else
+    return 0;
+#endif
+}
+
+/*********
+ * Trace *
+ *********/
+
+/**
+ * Record an event in the trace ring, if tracing is on.
+ */
+void Trace(int kind, int aux, int value) {
+    if (trace_ring == NULL) {
+        return;
+    }
+    TraceEvent *event = &trace_ring[trace_next];
+    event->time_us = (unsigned int)ServiceClock();
+    event->kind = kind;
+    event->aux = aux;
+    event->value = value;
+    trace_next = (trace_next + 1) % TRACE_EVENTS;
+    if (trace_count < TRACE_EVENTS) {
+        trace_count++;
+    } else {
+        trace_lost++;
+    }
+}
+
+/**
+ * Ring slot of the oldest undrained event.
+ */
+int TraceStart() {
+    return (trace_next - trace_count + TRACE_EVENTS) % TRACE_EVENTS;
+}
+
+/**
+ * Write the undrained events to trace_file, oldest first.
+ */
+void DumpTrace() {
+    if (trace_ring == NULL) {
+        return;
+    }
+    FILE *file = fopen(trace_file, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Cannot write trace to %s.\n", trace_file);
+        return;
+    }
+    int first = TraceStart();
+    int head = trace_count < TRACE_EVENTS - first ? trace_count : TRACE_EVENTS - first;
+    fwrite(trace_ring + first, sizeof(TraceEvent), head, file);
+    fwrite(trace_ring, sizeof(TraceEvent), trace_count - head, file);
+    fclose(file);
+    trace_count = 0;
+}
+
+/**********
+ * Record *
+ **********/
+
+/**
+ * Bytes of name or pathname the request names through its pointer.
+ */
+int RecordedLength(DataPacket *packet) {
+    switch (packet->packet_type) {
+        case MSG_SEARCH_FILE:
+        case MSG_CREATE_FILE:
+        case MSG_CREATE_DIR:
+        case MSG_DELETE_DIR:
+        case MSG_LINK:
+        case MSG_UNLINK:
+            return packet->pointer == NULL ? 0 : DIRNAMELEN;
+        case MSG_RESOLVE_PATH:
+            return packet->arg2 > 0 && packet->arg2 <= MAXPATHNAMELEN ? packet->arg2 : 0;
+    }
+    return 0;
+}
+
+/**
+ * Keep a received request, and fetch its name or pathname, for the
+ * record written at reply time.
+ */
+void StartRecord(void *packet, int pid) {
+    if (record_file == NULL) {
+        return;
+    }
+    memcpy(request_record.packet, packet, PACKET_SIZE);
+    request_record.pid = pid;
+    request_record.data_len = RecordedLength(packet);
+    if (request_record.data_len > 0 &&
+        CopyFrom(pid, record_data, ((DataPacket *)packet)->pointer, request_record.data_len) < 0) {
+        request_record.data_len = -1;
+    }
+}
+
+/**
+ * Append the request with its reply to the record file.
+ */
+void FinishRecord(void *reply, long long start) {
+    if (record_file == NULL) {
+        return;
+    }
+    request_record.service_us = (int)(ServiceClock() - start);
+    memcpy(request_record.reply, reply, PACKET_SIZE);
+    fwrite(&request_record, sizeof(RequestRecord), 1, record_file);
+    if (request_record.data_len > 0) {
+        fwrite(record_data, 1, request_record.data_len, record_file);
+    }
+}
 
 /*************************
  * Block and Inode Cache *
  *************************/
 
+/*
+ * Keys recently evicted from a cache, in a ring hashed for lookup.  A
+ * miss on a key still in the ring is a hit the cache would have had
+ * with that many more entries.
+ */
+struct ghost_list {
+    int *keys; //Ring of keys, next is the oldest
+    char *live; //Whether the ring slot is still in its bucket
+    int *chain; //Next ring slot in the same bucket, or -1
+    int *buckets; //First ring slot per bucket, or -1
+    int size;
+    int hash_size;
+    int next;
+};
+
 struct inode_cache {
     struct inode_cache_entry* top;
     struct inode_cache_entry* base; 
     struct inode_cache_entry** hash_set;
+    struct inode_cache_entry* entries; //stack_size preallocated entries
+    struct inode* arena; //The cached inodes, one per entry
+    struct inode_cache_entry** scratch; //stack_size pointers for sorting entries
+    struct ghost_list* evicted; //Inode numbers recently evicted
     int stack_size; 
     int hash_size;
 };
 
 struct inode_cache_entry {
-    struct inode* inode; //Item that this entry represents. Can either be a block or inode
-    int inum; //Inode/Block number of the cache entry.
+    struct inode* inode; //The entry's own copy in the arena
+    int inum; //Inode number of the cache entry, or -1 if unused.
     struct inode_cache_entry* prev_lru; 
     struct inode_cache_entry* next_lru;
     struct inode_cache_entry* prev_hash;
     struct inode_cache_entry* next_hash;
     int dirty; 
+    int next_pos; //Byte offset a sequential read would continue from
+    int last_start; //First block index of the last read
+    int last_stride; //Block distance between the last two reads
+    int window; //Blocks to read ahead, 0 while no pattern is seen
+    int readahead_next; //Block index sequential read-ahead resumes from
+    int alloc_goal; //Block to place a new file's first block near
+    int reserve_start; //Free blocks held back for the file's next appends
+    int reserve_end;
+    int map_first; //File block index that map[0] translates
+    int map_count; //Pointers held in map, 0 when empty
+    int map[PTRS_PER_BLOCK]; //Copy of the index block last looked up
 };
 
 struct block_cache {
     struct block_cache_entry* top; 
     struct block_cache_entry* base; 
+    struct block_cache_entry* probation_top; //2Q: blocks referenced once, FIFO
+    struct block_cache_entry* probation_base;
     struct block_cache_entry** hash_set;
+    struct block_cache_entry* entries; //stack_size slots
+    char* arena; //Sector-aligned buffers, one per slot
+    char* arena_base; //As allocated, before alignment
+    struct block_cache_entry** scratch; //stack_size pointers for sorting slots
+    struct ghost_list* ghosts; //2Q: block numbers recently evicted from probation
+    struct ghost_list* evicted; //Block numbers recently evicted from either list
     int stack_size; 
     int hash_size;
+    int probation_count;
 };
 
 struct block_cache_entry {
-    void* block;
-    int block_number; 
+    void* block; //Fixed buffer of this slot within the arena
+    int block_number; //Block number held in the slot, -1 if unused, or DELAYED_BLOCK
     struct block_cache_entry* prev_lru; 
     struct block_cache_entry* next_lru; 
     struct block_cache_entry* prev_hash;
     struct block_cache_entry* next_hash;
     int dirty;
+    int pins; //1 while the slot holds a delayed file block
+    int on_probation; //Whether the entry is on the probation list
+    int readahead; //Prefetched and not referenced yet
+    int delayed_inum; //File and block index of a slot with no disk block yet
+    int delayed_index;
+};
+
+int block_policy = CACHE_LRU;
+
+struct name_cache {
+    struct name_cache_entry* top;
+    struct name_cache_entry* base;
+    struct name_cache_entry** hash_set;
+    struct name_cache_entry* entries; //stack_size preallocated entries
+    struct ghost_list* evicted; //Name hashes recently evicted
+    int stack_size;
+    int hash_size;
+};
+
+struct name_cache_entry {
+    int parent_inum; //Directory holding the name, or -1 if unused.
+    char name[DIRNAMELEN];
+    int inum; //Inode the name maps to, 0 if the name is known to be absent
+    struct name_cache_entry* prev_lru;
+    struct name_cache_entry* next_lru;
+    struct name_cache_entry* prev_hash;
+    struct name_cache_entry* next_hash;
 };
 
 int inode_count;
 int block_count;
 struct block_cache* cache_for_blocks; 
 struct inode_cache* cache_for_inodes; 
+struct name_cache* cache_for_names;
 
-struct inode_cache *MakeInodeCache();
+struct inode_cache *MakeInodeCache(int num_inodes, int entries);
 
-struct block_cache *MakeBlockCache(int num_blocks);
+struct block_cache *MakeBlockCache(int num_blocks, int entries);
 
-void AddToInodeCache(struct inode_cache *cache, struct inode *in, int inumber);
+struct inode_cache_entry* AddToInodeCache(struct inode_cache *cache, int inumber);
 
-void AddToBlockCache(struct block_cache *cache, void* block, int block_number);
+void DirtyInode(struct inode_cache_entry *entry);
+
+void CleanInode(struct inode_cache_entry *entry);
+
+struct block_cache_entry* AddToBlockCache(struct block_cache *cache, int block_number, int readahead);
+
+void DirtyBlock(struct block_cache_entry *entry);
+
+void CleanBlock(struct block_cache_entry *entry);
 
 struct inode_cache_entry* FindInodeInCache(struct inode_cache *cache, int inumber);
 
 struct block_cache_entry* FindBlockInCache(struct block_cache *cache, int block_number);
 
+struct block_cache_entry* LookupBlock(struct block_cache *cache, int block_number);
+
+struct block_cache_entry* LookupDelayed(struct block_cache *cache, int inum, int index);
+
+void TouchBlock(struct block_cache *cache, struct block_cache_entry *block);
+
 void PopToFrontInode(struct inode_cache* cache, struct inode_cache_entry* recent_access);
 
 void PopToFrontBlock(struct block_cache *cache, struct block_cache_entry* recent_access);
 
-void WriteIntoInode(struct inode_cache_entry* out);
+void UnlinkBlock(struct block_cache_entry **top, struct block_cache_entry **base, struct block_cache_entry *entry);
+
+void PushBlock(struct block_cache_entry **top, struct block_cache_entry **base, struct block_cache_entry *entry);
+
+struct block_cache_entry* UnpinnedVictim(struct block_cache_entry *base);
+
+struct ghost_list *MakeGhostList(int size);
+
+void FreeGhostList(struct ghost_list *list);
+
+void NoteGhost(struct ghost_list *list, int key);
+
+int TakeGhost(struct ghost_list *list, int key);
+
+void HashBlock(struct block_cache *cache, struct block_cache_entry *entry);
+
+void WriteBackBlocks(struct block_cache_entry **blocks, int count);
+
+void WriteDirtyInodes();
+
+void WriteInodeBlock(int block_number);
+
+void NoteTransfer(int block_num, int reading);
 
 struct inode_cache_entry* SearchForInode(int inode_num);
 
 struct block_cache_entry* SearchForBlock(int block_num);
 
-int HashIndex(int key_value);
+struct block_cache_entry* OverwriteBlock(int block_num);
+
+struct block_cache_entry* ZeroBlock(int block_num);
+
+struct name_cache *MakeNameCache(int entries);
+
+int NameHash(int parent_inum, char *name);
+
+struct name_cache_entry* FindNameInCache(int parent_inum, char *name);
+
+void EnterName(int parent_inum, char *name, int inum);
+
+void ForgetDirectory(int dir_inum);
+
+void PopToFrontName(struct name_cache *cache, struct name_cache_entry *entry);
+
+void UnhashName(struct name_cache *cache, struct name_cache_entry *entry);
+
+int CompareDirname(char *dirname, char *other);
+
+void ReadAheadHit();
+
+void ReadAheadWasted();
+
+void ReleaseReservation(struct inode_cache_entry *entry);
+
+void DropReservations();
+
+void UnhashBlock(struct block_cache *cache, struct block_cache_entry *entry);
+
+void DiscardDelayed(int inum);
+
+void AllocateDelayed();
+
+void FreeFileBlocks(struct inode *inode, int keep);
+void TrimFileBlocks(struct inode_cache_entry *entry, int end);
+
+int HashIndex(unsigned int key_value, int hash_size);
+
+int HashSize(int entries);
 
 /*********************
  * Inode Cache Code *
  ********************/
 
 /**
- * New Inode Cache
+ * New Inode Cache of the given number of entries.
  */
-struct inode_cache *MakeInodeCache(int num_inodes) {
+struct inode_cache *MakeInodeCache(int num_inodes, int entries) {
     inode_count = num_inodes;
 
     struct inode_cache *new_cache = malloc(sizeof(struct inode_cache));
-    new_cache->stack_size = 0;
-    new_cache->hash_set = calloc((num_inodes/8) + 1, sizeof(struct inode_cache_entry));
-    new_cache->hash_size = (num_inodes/8) + 1;
+    new_cache->stack_size = entries;
+    new_cache->hash_size = HashSize(entries);
+    new_cache->hash_set = calloc(new_cache->hash_size, sizeof(struct inode_cache_entry *));
+    new_cache->entries = calloc(entries, sizeof(struct inode_cache_entry));
+    new_cache->arena = calloc(entries, sizeof(struct inode));
+    new_cache->scratch = malloc(entries * sizeof(struct inode_cache_entry *));
+    new_cache->evicted = MakeGhostList(entries);
     cache_for_inodes = new_cache;
 
-    struct inode* dummy_inode = malloc(sizeof(struct inode));
     int i;
-    for (i = 1; i <= INODE_CACHESIZE; i++) {
-        AddToInodeCache(new_cache, dummy_inode, -1 * i);
+    for (i = 0; i < entries; i++) {
+        struct inode_cache_entry *entry = &new_cache->entries[i];
+        entry->inode = &new_cache->arena[i];
+        entry->inum = -1;
+        entry->prev_lru = i > 0 ? &new_cache->entries[i - 1] : NULL;
+        entry->next_lru = i < entries - 1 ? &new_cache->entries[i + 1] : NULL;
     }
+    new_cache->top = &new_cache->entries[0];
+    new_cache->base = &new_cache->entries[entries - 1];
+    server_stats.inode_cache_entries = entries;
     return new_cache;
 }
 
 /**
- * Add new inode to cache.
+ * Put a filled entry in its hash chain.
  */
-void AddToInodeCache(struct inode_cache *cache, struct inode *inode, int inum) {
-    if (cache->stack_size == INODE_CACHESIZE) {
-        struct inode_cache_entry *entry = cache->base;
-        int old_index = HashIndex(entry->inum);
-        int new_index = HashIndex(inum);
+void HashInode(struct inode_cache *cache, struct inode_cache_entry *entry) {
+    int index = HashIndex(entry->inum, cache->hash_size);
+    entry->prev_hash = NULL;
+    entry->next_hash = cache->hash_set[index];
+    if (cache->hash_set[index] != NULL) {
+        cache->hash_set[index]->prev_hash = entry;
+    }
+    cache->hash_set[index] = entry;
+}
 
-        cache->base = cache->base->prev_lru;
-        cache->base->next_lru = NULL;
+/**
+ * Mark a cached inode as changed since it was last written.
+ */
+void DirtyInode(struct inode_cache_entry *entry) {
+    if (!entry->dirty) {
+        entry->dirty = 1;
+        dirty_inode_count++;
+    }
+}
 
-        if (entry->dirty && entry->inum > 0) WriteIntoInode(entry);
-        if (entry->prev_hash != NULL && entry->next_hash != NULL) {
-            entry->next_hash->prev_hash = entry->prev_hash;
+/**
+ * Mark a cached inode as matching the disk.
+ */
+void CleanInode(struct inode_cache_entry *entry) {
+    if (entry->dirty) {
+        entry->dirty = 0;
+        dirty_inode_count--;
+    }
+}
+
+/**
+ * Add new inode to cache, recycling the least recently used entry.
+ * The caller fills in the entry's copy of the inode.
+ */
+struct inode_cache_entry* AddToInodeCache(struct inode_cache *cache, int inum) {
+    struct inode_cache_entry *entry = cache->base;
+
+    if (entry->inum >= 0) {
+        server_stats.inode_evictions++;
+        Trace(TRACE_INODE_EVICT, entry->dirty, entry->inum);
+        if (entry->dirty) WriteInodeBlock(INODE_BLOCK(entry->inum));
+        ReleaseReservation(entry);
+        NoteGhost(cache->evicted, entry->inum);
+        if (entry->prev_hash != NULL) {
             entry->prev_hash->next_hash = entry->next_hash;
-        } else if (entry->prev_hash == NULL && entry->next_hash != NULL) {
-            cache->hash_set[old_index] = entry->next_hash;
-            entry->next_hash->prev_hash = NULL;
-        } else if (entry->prev_hash != NULL && entry->next_hash == NULL) {
-            entry->prev_hash->next_hash = NULL;
         } else {
-            cache->hash_set[old_index] = NULL;
+            cache->hash_set[HashIndex(entry->inum, cache->hash_size)] = entry->next_hash;
         }
-        entry->inode = inode;
-        entry->dirty = 0;
-        entry->inum = inum;
-        entry->prev_lru = NULL;
-        entry->next_lru = cache->top;
-        cache->top->prev_lru = entry;
-        cache->top = entry;
-        entry->prev_hash = NULL;
-        if (cache->hash_set[new_index] != NULL) {
-            cache->hash_set[new_index]->prev_hash = entry;
-        }
-        entry->next_hash = cache->hash_set[new_index];
-        cache->hash_set[new_index] = entry;
-    } else {
-        struct inode_cache_entry* item = malloc(sizeof(struct inode_cache_entry));
-        int index = HashIndex(inum);
-        item->inum = inum;
-        item->inode = inode;
-        item->prev_hash = NULL;
-        item->prev_lru = NULL;
-
-        if (cache->hash_set[index] != NULL) {
-            cache->hash_set[index]->prev_hash = item;
-        }
-        item->next_hash = cache->hash_set[index];
-        cache->hash_set[index] = item;
-
-        if (cache->stack_size == 0) {
-            cache->base = item;
-            cache->top = item;
-        } else {
-            item->next_lru = cache->top;
-            cache->top->prev_lru = item;
-            cache->top = item;
+        if (entry->next_hash != NULL) {
+            entry->next_hash->prev_hash = entry->prev_hash;
         }
-
-        cache->stack_size++;
     }
+
+    entry->inum = inum;
+    CleanInode(entry);
+    entry->next_pos = -1;
+    entry->last_start = -1;
+    entry->last_stride = 0;
+    entry->window = 0;
+    entry->readahead_next = 0;
+    entry->alloc_goal = 0;
+    entry->map_count = 0;
+    HashInode(cache, entry);
+
+    PopToFrontInode(cache, entry);
+    return entry;
 }
 
 /**
- * Look up inode in cache.
+ * Look up inode in cache without changing its place in the LRU order.
  */
-struct inode_cache_entry* FindInodeInCache(struct inode_cache *cache, int inum) {
+struct inode_cache_entry* LookupInode(struct inode_cache *cache, int inum) {
     struct inode_cache_entry* ice;
-    for (ice = cache->hash_set[HashIndex(inum)]; ice != NULL; ice = ice->next_hash) {
+    for (ice = cache->hash_set[HashIndex(inum, cache->hash_size)]; ice != NULL; ice = ice->next_hash) {
         if (ice->inum == inum) {
-            PopToFrontInode(cache, ice);
             return ice;
         }
     }
@@ -302,42 +702,94 @@ struct inode_cache_entry* FindInodeInCache(struct inode_cache *cache, int inum)
 }
 
 /**
- * Write into inode.
+ * Look up inode in cache.
+ */
+struct inode_cache_entry* FindInodeInCache(struct inode_cache *cache, int inum) {
+    struct inode_cache_entry* ice = LookupInode(cache, inum);
+    if (ice != NULL) {
+        PopToFrontInode(cache, ice);
+    }
+    return ice;
+}
+
+char inode_sector[SECTORSIZE]; //Inode-table block last read or written back
+int inode_sector_block = 0; //Block inode_sector holds, 0 for none
+
+/**
+ * Inode-table block buffer for block_number: the header's sector for
+ * block 1, which is always current in memory, else inode_sector,
+ * reading the block in unless inode_sector already holds it.  The read
+ * is also skipped when every inode of the block is cached, if
+ * will_overwrite says they are all about to be copied over it.
+ */
+struct inode *LoadInodeBlock(int block_number, int will_overwrite) {
+    if (block_number == 1) {
+        return (struct inode *)file_system_header;
+    }
+    if (block_number == inode_sector_block) {
+        return (struct inode *)inode_sector;
+    }
+
+    int first = (block_number - 1) * INODE_PER_BLOCK;
+    int k;
+    for (k = 0; will_overwrite && k < INODE_PER_BLOCK; k++) {
+        if (LookupInode(cache_for_inodes, first + k) == NULL) {
+            will_overwrite = 0;
+        }
+    }
+    if (!will_overwrite) {
+        NoteTransfer(block_number, 1);
+        server_stats.sector_reads++;
+        ReadSector(block_number, inode_sector);
+    }
+    inode_sector_block = block_number;
+    return (struct inode *)inode_sector;
+}
+
+/**
+ * Write an inode-table block back with every cached inode it holds, so
+ * one sector write carries all of its dirty inodes.  Block 1 also
+ * carries the header.
  */
-void WriteIntoInode(struct inode_cache_entry* out) {
-    struct block_cache_entry* inode_block_entry = SearchForBlock((out->inum / 8) + 1);
-    void* inode_block = inode_block_entry->block;
-    struct inode* overwrite = (struct inode *)inode_block + (out->inum % 8);
-    inode_block_entry->dirty = 1;
-    memcpy(overwrite, out->inode, sizeof(struct inode));
-    out->dirty = 0;
+void WriteInodeBlock(int block_number) {
+    struct inode *sector = LoadInodeBlock(block_number, 1);
+    int first = (block_number - 1) * INODE_PER_BLOCK;
+    int k;
+    for (k = 0; k < INODE_PER_BLOCK; k++) {
+        struct inode_cache_entry *entry = LookupInode(cache_for_inodes, first + k);
+        if (first + k > 0 && entry != NULL) {
+            memcpy(&sector[k], entry->inode, sizeof(struct inode));
+            CleanInode(entry);
+        }
+    }
+    if (block_number == 1) {
+        header_dirty = 0;
+    }
+    NoteTransfer(block_number, 0);
+    server_stats.sector_writes++;
+    server_stats.inode_writebacks++;
+    WriteSector(block_number, sector);
 }
 
 /**
  * Pop inode and place at top of cache.
  */
 void PopToFrontInode(struct inode_cache* cache, struct inode_cache_entry* recent_access) {
-    bool compare_inums = recent_access->inum == cache->top->inum;
-    bool compare_lrus = recent_access->prev_lru == NULL && recent_access->next_lru == NULL;
-    if (compare_inums || compare_lrus) {
+    if (recent_access == cache->top) {
         return;
     }
 
-    if (recent_access->inum == cache->base->inum) {
-        recent_access->prev_lru->next_lru = NULL;
+    if (recent_access == cache->base) {
         cache->base = recent_access->prev_lru;
-
-        recent_access->next_lru = cache->top;
-        cache->top->prev_lru = recent_access;
-        cache->top = recent_access;
+        cache->base->next_lru = NULL;
     } else {
         recent_access->next_lru->prev_lru = recent_access->prev_lru;
         recent_access->prev_lru->next_lru = recent_access->next_lru;
-
-        recent_access->next_lru = cache->top;
-        cache->top->prev_lru = recent_access;
-        cache->top = recent_access;
     }
+    recent_access->prev_lru = NULL;
+    recent_access->next_lru = cache->top;
+    cache->top->prev_lru = recent_access;
+    cache->top = recent_access;
 }
 
 /**
@@ -346,14 +798,18 @@ void PopToFrontInode(struct inode_cache* cache, struct inode_cache_entry* recent
 struct inode_cache_entry* SearchForInode(int inum) {
     struct inode_cache_entry* current = FindInodeInCache(cache_for_inodes, inum);
     if (current != NULL) {
+        server_stats.inode_hits++;
+        Trace(TRACE_INODE_HIT, 0, inum);
         return current;
     }
 
-    struct block_cache_entry* block_entry = SearchForBlock((inum / 8) + 1);
-    void* inode_block = block_entry->block;
-
-    AddToInodeCache(cache_for_inodes, (struct inode *)inode_block + (inum % 8), inum);
-    return cache_for_inodes->top;
+    server_stats.inode_misses++;
+    Trace(TRACE_INODE_MISS, 0, inum);
+    server_stats.inode_ghost_hits += TakeGhost(cache_for_inodes->evicted, inum);
+    current = AddToInodeCache(cache_for_inodes, inum);
+    struct inode *sector = LoadInodeBlock(INODE_BLOCK(inum), 0);
+    memcpy(current->inode, &sector[inum % INODE_PER_BLOCK], sizeof(struct inode));
+    return current;
 }
 
 /*********************
@@ -361,340 +817,2063 @@ struct inode_cache_entry* SearchForInode(int inum) {
  ********************/
 
 /**
- * Create cache for blocks.
+ * Move the notional disk head to a block transferred through the
+ * cache, counting the distance for reads.
+ */
+void NoteTransfer(int block_num, int reading) {
+    Trace(reading ? TRACE_SECTOR_READ : TRACE_SECTOR_WRITE, 0, block_num);
+    if (reading) {
+        server_stats.read_seek_distance += abs(block_num - disk_head);
+    }
+    disk_head = block_num;
+}
+
+/**
+ * Create cache for blocks with the given number of slots.
+ *
+ * All sector buffers live in one sector-aligned arena and their
+ * entries in one array, so a miss only recycles a slot.
  */
-struct block_cache *MakeBlockCache(int num_blocks) {
+struct block_cache *MakeBlockCache(int num_blocks, int entries) {
     block_count = num_blocks;
     struct block_cache *new_cache = malloc(sizeof(struct block_cache));
-    new_cache->stack_size = 0;
-    new_cache->hash_set = calloc((num_blocks/8) + 1, sizeof(struct block_cache_entry));
-    new_cache->hash_size = (num_blocks/8) + 1;
+    new_cache->stack_size = entries;
+    new_cache->hash_size = HashSize(entries);
+    new_cache->hash_set = calloc(new_cache->hash_size, sizeof(struct block_cache_entry *));
+    new_cache->entries = calloc(entries, sizeof(struct block_cache_entry));
+    new_cache->scratch = malloc(entries * sizeof(struct block_cache_entry *));
+
+    new_cache->arena_base = malloc((entries + 1) * SECTORSIZE);
+    new_cache->arena = new_cache->arena_base +
+        (SECTORSIZE - (unsigned long)new_cache->arena_base % SECTORSIZE) % SECTORSIZE;
+
+    int i;
+    for (i = 0; i < entries; i++) {
+        struct block_cache_entry *entry = &new_cache->entries[i];
+        entry->block = new_cache->arena + i * SECTORSIZE;
+        entry->block_number = -1;
+        entry->prev_lru = i > 0 ? &new_cache->entries[i - 1] : NULL;
+        entry->next_lru = i < entries - 1 ? &new_cache->entries[i + 1] : NULL;
+    }
+    new_cache->top = &new_cache->entries[0];
+    new_cache->base = &new_cache->entries[entries - 1];
+    new_cache->probation_top = NULL;
+    new_cache->probation_base = NULL;
+    new_cache->probation_count = 0;
+    new_cache->ghosts = MakeGhostList(entries / 2);
+    new_cache->evicted = MakeGhostList(entries);
     cache_for_blocks = new_cache;
+    server_stats.block_cache_entries = entries;
     return new_cache;
 }
 
 /**
- * Add inode to cache.
+ * Give block_number the least recently used slot not holding a delayed
+ * block, writing back its old contents if dirty.  The caller fills the
+ * slot's buffer.
+ *
+ * Under CACHE_2Q a block seen for the first time goes on a short FIFO
+ * probation list and only reaches the main LRU list when it is missed
+ * again soon after leaving it.  Hits while it is on probation are one
+ * correlated use, such as a scan reading a block in small pieces.  A
+ * long sequential read then cycles through probation alone and cannot
+ * push directory, indirect and inode blocks out of the cache.
+ * Read-ahead blocks always start on probation, under either policy.
  */
-void AddToBlockCache(struct block_cache *cache, void* block, int block_number) {
-    if (cache->stack_size == BLOCK_CACHESIZE) {
-        struct block_cache_entry *entry = cache->base;
-
-        cache->base = cache->base->prev_lru;
-        cache->base->next_lru = NULL;
+struct block_cache_entry* AddToBlockCache(struct block_cache *cache, int block_number, int readahead) {
+    struct block_cache_entry *entry = NULL;
+    if (cache->probation_count >= PROBATION_SIZE) {
+        entry = UnpinnedVictim(cache->probation_base);
+    }
+    if (entry == NULL) {
+        entry = UnpinnedVictim(cache->base);
+    }
+    if (entry == NULL) {
+        entry = UnpinnedVictim(cache->probation_base);
+    }
+    if (entry == NULL) {
+        /* Every slot holds a delayed block.  DELAYED_MAX should keep
+         * that from happening, but a delayed slot is never reused:
+         * giving them disk blocks unpins them all. */
+        AllocateDelayed();
+        entry = UnpinnedVictim(cache->base);
+        if (entry == NULL) {
+            entry = UnpinnedVictim(cache->probation_base);
+        }
+    }
 
-        int old_index = HashIndex(entry->block_number);
-        int new_index = HashIndex(block_number);
+    if (entry->on_probation) {
+        UnlinkBlock(&cache->probation_top, &cache->probation_base, entry);
+        cache->probation_count--;
+        if (entry->block_number > 0 && !entry->readahead) {
+            NoteGhost(cache->ghosts, entry->block_number);
+        }
+    } else {
+        UnlinkBlock(&cache->top, &cache->base, entry);
+    }
 
-        if (entry->dirty && entry->block_number > 0) {
+    if (entry->block_number > 0) {
+        server_stats.block_evictions++;
+        Trace(TRACE_BLOCK_EVICT, entry->dirty, entry->block_number);
+        if (entry->dirty) {
+            NoteTransfer(entry->block_number, 0);
             WriteSector(entry->block_number, entry->block);
+            server_stats.sector_writes++;
+            server_stats.block_writebacks++;
         }
-        if (entry->next_hash != NULL && entry->prev_hash != NULL) {
-            entry->prev_hash->next_hash = entry->next_hash;
-            entry->next_hash->prev_hash = entry->prev_hash;
-        } else if(entry->next_hash == NULL && entry->prev_hash != NULL) {
-            entry->prev_hash->next_hash = NULL;
-        } else if(entry->next_hash != NULL && entry->prev_hash == NULL) {
-            cache->hash_set[old_index] = entry->next_hash;
-            entry->next_hash->prev_hash = NULL;
+        if (entry->readahead) {
+            server_stats.readahead_wasted++;
+            ReadAheadWasted();
         } else {
-            cache->hash_set[old_index] = NULL;
+            NoteGhost(cache->evicted, entry->block_number);
         }
+    }
+    if (entry->block_number != -1) {
+        UnhashBlock(cache, entry);
+    }
+
+    entry->block_number = block_number;
+    CleanBlock(entry);
+    entry->readahead = readahead;
+    HashBlock(cache, entry);
+
+    if (readahead || (block_policy == CACHE_2Q && !TakeGhost(cache->ghosts, block_number))) {
+        entry->on_probation = 1;
+        PushBlock(&cache->probation_top, &cache->probation_base, entry);
+        cache->probation_count++;
+    } else {
+        entry->on_probation = 0;
+        PushBlock(&cache->top, &cache->base, entry);
+    }
+    return entry;
+}
+
+/**
+ * Hash chain of the delayed slot for block index of file inum.  The
+ * key wraps for large inode numbers, which only shares a chain.
+ */
+int DelayedHashIndex(int inum, int index, int hash_size) {
+    return HashIndex((unsigned int)inum * MAX_FILE_BLOCKS + (unsigned int)index, hash_size);
+}
+
+/**
+ * Hash chain of a filled slot: by block number, or by file and block
+ * index for a delayed one.
+ */
+int BlockHashIndex(struct block_cache *cache, struct block_cache_entry *entry) {
+    if (entry->block_number == DELAYED_BLOCK) {
+        return DelayedHashIndex(entry->delayed_inum, entry->delayed_index, cache->hash_size);
+    }
+    return HashIndex(entry->block_number, cache->hash_size);
+}
+
+/**
+ * Put a filled slot in its hash chain.
+ */
+void HashBlock(struct block_cache *cache, struct block_cache_entry *entry) {
+    int index = BlockHashIndex(cache, entry);
+    entry->prev_hash = NULL;
+    entry->next_hash = cache->hash_set[index];
+    if (cache->hash_set[index] != NULL) {
+        cache->hash_set[index]->prev_hash = entry;
+    }
+    cache->hash_set[index] = entry;
+}
+
+/**
+ * Take a slot out of its hash chain.
+ */
+void UnhashBlock(struct block_cache *cache, struct block_cache_entry *entry) {
+    if (entry->prev_hash != NULL) {
+        entry->prev_hash->next_hash = entry->next_hash;
+    } else {
+        cache->hash_set[BlockHashIndex(cache, entry)] = entry->next_hash;
+    }
+    if (entry->next_hash != NULL) {
+        entry->next_hash->prev_hash = entry->prev_hash;
+    }
+}
+
+/**
+ * Mark a block cache slot as changed since it was last written.
+ */
+void DirtyBlock(struct block_cache_entry *entry) {
+    if (!entry->dirty) {
+        entry->dirty = 1;
+        dirty_block_count++;
+    }
+}
 
-        entry->block = block;
+/**
+ * Mark a block cache slot as matching the disk.
+ */
+void CleanBlock(struct block_cache_entry *entry) {
+    if (entry->dirty) {
         entry->dirty = 0;
-        entry->block_number = block_number;
-        entry->prev_lru = NULL;
-        entry->next_lru = cache->top;
-        cache->top->prev_lru = entry;
-        cache->top = entry;
-        entry->prev_hash = NULL;
-
-        if (cache->hash_set[new_index] != NULL) {
-            cache->hash_set[new_index]->prev_hash = entry;
-        }
-        entry->next_hash = cache->hash_set[new_index];
-        cache->hash_set[new_index] = entry;
+        dirty_block_count--;
+    }
+}
+
+/**
+ * Empty a slot without writing it back.
+ */
+void ForgetBlock(struct block_cache *cache, struct block_cache_entry *entry) {
+    UnhashBlock(cache, entry);
+    entry->block_number = -1;
+    CleanBlock(entry);
+    entry->readahead = 0;
+}
+
+/**
+ * Move a slot to the hash chain of a new block number.
+ */
+void RehashBlock(struct block_cache *cache, struct block_cache_entry *entry, int block_number) {
+    UnhashBlock(cache, entry);
+    entry->block_number = block_number;
+    HashBlock(cache, entry);
+}
+
+/**
+ * Search for block in cache.  The first reference to a read-ahead block
+ * counts as its first use, so it stays on probation.
+ */
+struct block_cache_entry* FindBlockInCache(struct block_cache *cache, int block_number) {
+    struct block_cache_entry* block = LookupBlock(cache, block_number);
+    if (block != NULL) {
+        TouchBlock(cache, block);
+    }
+    return block;
+}
+
+/**
+ * Note a reference to a cached block.
+ */
+void TouchBlock(struct block_cache *cache, struct block_cache_entry *block) {
+    if (block->readahead) {
+        block->readahead = 0;
+        server_stats.readahead_hits++;
+        ReadAheadHit();
     } else {
-        struct block_cache_entry* item = malloc(sizeof(struct inode_cache_entry));
-        item->block_number = block_number;
-        item->block = block;
-        if (cache->hash_set[HashIndex(block_number)] != NULL) {
-            cache->hash_set[HashIndex(block_number)]->prev_hash = item;
-        }
-        item->next_hash = cache->hash_set[HashIndex(block_number)];
-        item->prev_hash = NULL;
-        item->prev_lru = NULL;
-        cache->hash_set[HashIndex(block_number)] = item;
-        if (cache->stack_size == 0) {
-            cache->top = item;
-            cache->base = item;
-        } else {
-            item->next_lru = cache->top;
-            cache->top->prev_lru = item;
-            cache->top = item;
+        PopToFrontBlock(cache, block);
+    }
+}
+
+/**
+ * Find block in cache without touching its list position.
+ */
+struct block_cache_entry* LookupBlock(struct block_cache *cache, int block_number) {
+    struct block_cache_entry* block;
+    block = cache->hash_set[HashIndex(block_number, cache->hash_size)];
+    while (block != NULL) {
+        if (block->block_number == block_number) {
+            return block;
         }
-        cache->stack_size = cache->stack_size + 1;
+        block = block->next_hash;
+    }
+    return NULL;
+}
+
+/**
+ * Find the delayed slot of block index of file inum without touching
+ * its list position.
+ */
+struct block_cache_entry* LookupDelayed(struct block_cache *cache, int inum, int index) {
+    struct block_cache_entry* block;
+    block = cache->hash_set[DelayedHashIndex(inum, index, cache->hash_size)];
+    while (block != NULL) {
+        if (block->block_number == DELAYED_BLOCK && block->delayed_inum == inum && block->delayed_index == index) {
+            return block;
+        }
+        block = block->next_hash;
+    }
+    return NULL;
+}
+
+/**
+ * Pop block and place at top of cache.  Under CACHE_2Q a block on
+ * probation stays where it is: references while it is there count as
+ * one, and it only earns the main list by a ghost hit once it has
+ * left.  Under LRU a used read-ahead block is promoted here.
+ */
+void PopToFrontBlock(struct block_cache *cache, struct block_cache_entry* recent_access) {
+    if (recent_access == cache->top) {
+        return;
+    }
+    if (recent_access->on_probation) {
+        if (block_policy == CACHE_2Q) {
+            return;
+        }
+        UnlinkBlock(&cache->probation_top, &cache->probation_base, recent_access);
+        cache->probation_count--;
+        recent_access->on_probation = 0;
+    } else {
+        UnlinkBlock(&cache->top, &cache->base, recent_access);
+    }
+    PushBlock(&cache->top, &cache->base, recent_access);
+}
+
+/**
+ * Remove entry from the list running from top to base.
+ */
+void UnlinkBlock(struct block_cache_entry **top, struct block_cache_entry **base, struct block_cache_entry *entry) {
+    if (entry->prev_lru != NULL) {
+        entry->prev_lru->next_lru = entry->next_lru;
+    } else {
+        *top = entry->next_lru;
+    }
+    if (entry->next_lru != NULL) {
+        entry->next_lru->prev_lru = entry->prev_lru;
+    } else {
+        *base = entry->prev_lru;
+    }
+    entry->prev_lru = NULL;
+    entry->next_lru = NULL;
+}
+
+/**
+ * Place entry at the top of the list running from top to base.
+ */
+void PushBlock(struct block_cache_entry **top, struct block_cache_entry **base, struct block_cache_entry *entry) {
+    entry->prev_lru = NULL;
+    entry->next_lru = *top;
+    if (*top != NULL) {
+        (*top)->prev_lru = entry;
+    } else {
+        *base = entry;
+    }
+    *top = entry;
+}
+
+/**
+ * Least recently used entry at or above base that no inode is pinning.
+ */
+struct block_cache_entry* UnpinnedVictim(struct block_cache_entry *base) {
+    struct block_cache_entry *entry = base;
+    while (entry != NULL && entry->pins > 0) {
+        entry = entry->prev_lru;
+    }
+    return entry;
+}
+
+/**
+ * New empty ghost list holding up to size keys.
+ */
+struct ghost_list *MakeGhostList(int size) {
+    struct ghost_list *list = malloc(sizeof(struct ghost_list));
+    list->size = size > 0 ? size : 1;
+    list->hash_size = HashSize(list->size);
+    list->keys = malloc(list->size * sizeof(int));
+    list->live = calloc(list->size, 1);
+    list->chain = malloc(list->size * sizeof(int));
+    list->buckets = malloc(list->hash_size * sizeof(int));
+    memset(list->buckets, -1, list->hash_size * sizeof(int));
+    list->next = 0;
+    return list;
+}
+
+void FreeGhostList(struct ghost_list *list) {
+    free(list->keys);
+    free(list->live);
+    free(list->chain);
+    free(list->buckets);
+    free(list);
+}
+
+/**
+ * Take ring slot out of its bucket.
+ */
+void UnlinkGhost(struct ghost_list *list, int slot) {
+    int *link = &list->buckets[HashIndex(list->keys[slot], list->hash_size)];
+    while (*link != slot) {
+        link = &list->chain[*link];
+    }
+    *link = list->chain[slot];
+    list->live[slot] = 0;
+}
+
+/**
+ * Remember an evicted key, forgetting the oldest one.
+ */
+void NoteGhost(struct ghost_list *list, int key) {
+    int slot = list->next;
+    if (list->live[slot]) {
+        UnlinkGhost(list, slot);
+    }
+    int bucket = HashIndex(key, list->hash_size);
+    list->keys[slot] = key;
+    list->live[slot] = 1;
+    list->chain[slot] = list->buckets[bucket];
+    list->buckets[bucket] = slot;
+    list->next = (slot + 1) % list->size;
+}
+
+/**
+ * Whether key was recently evicted, forgetting it if so.
+ */
+int TakeGhost(struct ghost_list *list, int key) {
+    int slot;
+    for (slot = list->buckets[HashIndex(key, list->hash_size)]; slot >= 0; slot = list->chain[slot]) {
+        if (list->keys[slot] == key) {
+            UnlinkGhost(list, slot);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * Search for block.
+ */
+struct block_cache_entry* SearchForBlock(int block_num) {
+    struct block_cache_entry *current = FindBlockInCache(cache_for_blocks,block_num);
+    if (current != NULL) {
+        server_stats.block_hits++;
+        Trace(TRACE_BLOCK_HIT, 0, block_num);
+        return current;
+    }
+
+    server_stats.block_misses++;
+    Trace(TRACE_BLOCK_MISS, 0, block_num);
+    server_stats.block_ghost_hits += TakeGhost(cache_for_blocks->evicted, block_num);
+    current = AddToBlockCache(cache_for_blocks, block_num, 0);
+    NoteTransfer(block_num, 1);
+    ReadSector(block_num, current->block);
+    server_stats.sector_reads++;
+    return current;
+}
+
+/**
+ * Search for a block the caller will overwrite in full: a miss takes a
+ * slot without reading the disk, leaving stale bytes in the buffer.
+ */
+struct block_cache_entry* OverwriteBlock(int block_num) {
+    struct block_cache_entry *current = FindBlockInCache(cache_for_blocks, block_num);
+    if (current != NULL) {
+        server_stats.block_hits++;
+        Trace(TRACE_BLOCK_HIT, 0, block_num);
+        return current;
+    }
+
+    server_stats.block_misses++;
+    Trace(TRACE_BLOCK_MISS, 0, block_num);
+    return AddToBlockCache(cache_for_blocks, block_num, 0);
+}
+
+/**
+ * Cache slot for a newly allocated block, zeroed and dirty, without
+ * reading its old contents.
+ */
+struct block_cache_entry* ZeroBlock(int block_num) {
+    struct block_cache_entry *current = OverwriteBlock(block_num);
+    memset(current->block, 0, BLOCKSIZE);
+    DirtyBlock(current);
+    return current;
+}
+
+/***************************
+ * Directory Entry Cache *
+ ***************************/
+
+/**
+ * Create cache of (directory, name) lookups, including names known to
+ * be absent.  It is sized on its own so path components stay cached
+ * however much data goes through the block cache.
+ */
+struct name_cache *MakeNameCache(int entries) {
+    struct name_cache *new_cache = malloc(sizeof(struct name_cache));
+    new_cache->stack_size = entries;
+    new_cache->hash_size = HashSize(entries);
+    new_cache->hash_set = calloc(new_cache->hash_size, sizeof(struct name_cache_entry *));
+    new_cache->entries = calloc(entries, sizeof(struct name_cache_entry));
+    new_cache->evicted = MakeGhostList(entries);
+
+    int i;
+    for (i = 0; i < entries; i++) {
+        struct name_cache_entry *entry = &new_cache->entries[i];
+        entry->parent_inum = -1;
+        entry->prev_lru = i > 0 ? &new_cache->entries[i - 1] : NULL;
+        entry->next_lru = i < entries - 1 ? &new_cache->entries[i + 1] : NULL;
+    }
+    new_cache->top = &new_cache->entries[0];
+    new_cache->base = &new_cache->entries[entries - 1];
+    cache_for_names = new_cache;
+    server_stats.name_cache_entries = entries;
+    return new_cache;
+}
+
+/**
+ * Hash key of a directory and a name within it.
+ */
+int NameHash(int parent_inum, char *name) {
+    unsigned int hash = (unsigned int)parent_inum;
+    int i;
+    for (i = 0; i < DIRNAMELEN && name[i] != '\0'; i++) {
+        hash = hash * 31 + (unsigned char)name[i];
+    }
+    return (int)hash;
+}
+
+/**
+ * Move name entry to the top of the LRU list.
+ */
+void PopToFrontName(struct name_cache *cache, struct name_cache_entry *entry) {
+    if (entry == cache->top) {
+        return;
+    }
+
+    if (entry == cache->base) {
+        cache->base = entry->prev_lru;
+        cache->base->next_lru = NULL;
+    } else {
+        entry->next_lru->prev_lru = entry->prev_lru;
+        entry->prev_lru->next_lru = entry->next_lru;
+    }
+    entry->prev_lru = NULL;
+    entry->next_lru = cache->top;
+    cache->top->prev_lru = entry;
+    cache->top = entry;
+}
+
+/**
+ * Remove name entry from its hash chain and mark it unused.
+ */
+void UnhashName(struct name_cache *cache, struct name_cache_entry *entry) {
+    if (entry->prev_hash != NULL) {
+        entry->prev_hash->next_hash = entry->next_hash;
+    } else {
+        cache->hash_set[HashIndex(NameHash(entry->parent_inum, entry->name), cache->hash_size)] = entry->next_hash;
+    }
+    if (entry->next_hash != NULL) {
+        entry->next_hash->prev_hash = entry->prev_hash;
+    }
+    entry->parent_inum = -1;
+}
+
+/**
+ * Look up name in directory parent_inum.
+ */
+struct name_cache_entry* FindNameInCache(int parent_inum, char *name) {
+    struct name_cache *cache = cache_for_names;
+    struct name_cache_entry *entry = cache->hash_set[HashIndex(NameHash(parent_inum, name), cache->hash_size)];
+    for (; entry != NULL; entry = entry->next_hash) {
+        if (entry->parent_inum == parent_inum && CompareDirname(entry->name, name) == 0) {
+            PopToFrontName(cache, entry);
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Record that name in directory parent_inum maps to inum, or to
+ * nothing if inum is 0.
+ */
+void EnterName(int parent_inum, char *name, int inum) {
+    struct name_cache *cache = cache_for_names;
+    struct name_cache_entry *entry = FindNameInCache(parent_inum, name);
+    if (entry != NULL) {
+        entry->inum = inum;
+        return;
+    }
+
+    entry = cache->base;
+    if (entry->parent_inum >= 0) {
+        NoteGhost(cache->evicted, NameHash(entry->parent_inum, entry->name));
+        UnhashName(cache, entry);
+    }
+
+    int index = HashIndex(NameHash(parent_inum, name), cache->hash_size);
+    entry->parent_inum = parent_inum;
+    SetDirectoryName(entry->name, name, 0, DIRNAMELEN);
+    entry->inum = inum;
+    entry->prev_hash = NULL;
+    entry->next_hash = cache->hash_set[index];
+    if (cache->hash_set[index] != NULL) {
+        cache->hash_set[index]->prev_hash = entry;
+    }
+    cache->hash_set[index] = entry;
+    PopToFrontName(cache, entry);
+}
+
+/**
+ * Drop every cached name inside a deleted directory, since its inode
+ * number may be reused.
+ */
+void ForgetDirectory(int dir_inum) {
+    int i;
+    for (i = 0; i < cache_for_names->stack_size; i++) {
+        if (cache_for_names->entries[i].parent_inum == dir_inum) {
+            UnhashName(cache_for_names, &cache_for_names->entries[i]);
+        }
+    }
+}
+
+/*
+ * Hash the key value into one of hash_size buckets.
+ *
+ * Multiplicative (Fibonacci) hashing spreads consecutive block and
+ * inode numbers over the table; hash_size must be a power of two.
+ */
+int HashIndex(unsigned int key_value, int hash_size) {
+    unsigned int hash = key_value * 2654435761u;
+    hash ^= hash >> 16;
+    return hash & (hash_size - 1);
+}
+
+/*
+ * Bucket count for a cache of the given size: the smallest power of
+ * two that keeps the load factor at or below one half.
+ */
+int HashSize(int entries) {
+    int size = 1;
+    while (size < 2 * entries) {
+        size = size * 2;
+    }
+    return size;
+}
+
+/*
+ * Compare dirnames.
+ */
+int CompareDirname(char *dirname, char *other);
+
+/*
+ * Compare dirnames.
+ */
+ int CompareDirname(char *dirname, char *other) {
+     int i;
+     for (i = 0; i < DIRNAMELEN; i++) {
+         if (dirname[i] != other[i]) {
+            return -1;
+         }
+
+        if (dirname[i] == '\0') {
+            break;
+        }
+     }
+
+     return 0;
+ }
+
+/**********************
+ * Allocation Bitmaps *
+ **********************/
+
+/**
+ * Mark the header on disk as clean or not.  Leaving the clean state is
+ * written through at once, so a crash before the next sync makes the
+ * next mount rebuild the bitmaps.
+ */
+void SetHeaderClean(int clean) {
+    file_system_header->padding[FS_CLEAN_SLOT] = clean;
+    header_dirty = 1;
+    if (!clean) {
+        NoteTransfer(1, 0);
+        WriteSector(1, file_system_header);
+        server_stats.sector_writes++;
+        header_dirty = 0;
+    }
+    header_clean = clean;
+}
+
+/**
+ * Set or clear bit n of a bitmap.
+ */
+void SetBit(unsigned char *bitmap, int n, int used) {
+    if (used) {
+        bitmap[n / 8] |= 1 << (n % 8);
+    } else {
+        bitmap[n / 8] &= ~(1 << (n % 8));
+    }
+}
+
+/**
+ * Set or clear bit n of an allocation bitmap, noting that the bitmaps
+ * on disk are out of date.
+ */
+void MarkBitmap(unsigned char *bitmap, int n, int used) {
+    if (bitmap == NULL) {
+        return;
+    }
+    SetBit(bitmap, n, used);
+    if (!bitmaps_on_disk) {
+        return;
+    }
+    if (header_clean) {
+        SetHeaderClean(0);
+    }
+    bitmaps_dirty = 1;
+}
+
+/**
+ * Whether bit n of an allocation bitmap is set.
+ */
+int TestBitmap(unsigned char *bitmap, int n) {
+    return (bitmap[n / 8] >> (n % 8)) & 1;
+}
+
+/**
+ * Whether block n is allocated or held back for some file's appends.
+ */
+int BlockTaken(int n) {
+    return TestBitmap(block_bitmap, n) || TestBitmap(reserve_bitmap, n);
+}
+
+/**
+ * First block at or after start that begins a run of at least run free
+ * blocks, wrapping around the data area once, or 0 if there is none.
+ */
+int FindFreeRun(int start, int run) {
+    int pass;
+    for (pass = 0; pass < 2; pass++) {
+        int from = pass == 0 ? start : first_data_block;
+        int to = pass == 0 ? data_block_end : start + run - 1;
+        if (to > data_block_end) {
+            to = data_block_end;
+        }
+
+        int length = 0;
+        int i;
+        for (i = from; i < to; i++) {
+            if (length == 0 && i % 8 == 0 && (block_bitmap[i / 8] | reserve_bitmap[i / 8]) == 0xff
+                    && i + 8 <= to) {
+                i += 7;
+                continue;
+            }
+            if (BlockTaken(i)) {
+                length = 0;
+                continue;
+            }
+            if (++length == run) {
+                return i - run + 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Take a free block, or 0 if there is none.
+ *
+ * goal is where the caller would like the block: the block after the
+ * file's last one when extending it, or a block of its parent for a
+ * new file.  goal itself is taken whenever it is free.  Otherwise the
+ * search goes on from goal for the start of a free run of at least run
+ * blocks, halving run until something is found, so that the blocks
+ * which follow can stay contiguous.  With no goal, the search starts
+ * after the last block handed out.
+ */
+int AllocateBlock(int goal, int run) {
+    if (free_block_count == 0) {
+        return 0;
+    }
+    server_stats.alloc_blocks++;
+    int block_number = goal;
+    if (goal < first_data_block || goal >= data_block_end || BlockTaken(goal)) {
+        server_stats.alloc_runs++;
+        if (goal < first_data_block || goal >= data_block_end) {
+            goal = alloc_cursor;
+        }
+        block_number = 0;
+        for (; block_number == 0 && run > 0; run /= 2) {
+            block_number = FindFreeRun(goal, run);
+        }
+        if (block_number == 0) {
+            DropReservations();
+            block_number = FindFreeRun(goal, 1);
+        }
+        if (block_number == 0) {
+            return 0;
+        }
+    }
+
+    MarkBitmap(block_bitmap, block_number, 1);
+    free_block_count--;
+    alloc_cursor = block_number + 1 < data_block_end ? block_number + 1 : first_data_block;
+    return block_number;
+}
+
+/**
+ * Give back the blocks held for a file's appends.
+ */
+void ReleaseReservation(struct inode_cache_entry *entry) {
+    int i;
+    for (i = entry->reserve_start; i < entry->reserve_end; i++) {
+        SetBit(reserve_bitmap, i, 0);
+    }
+    entry->reserve_start = 0;
+    entry->reserve_end = 0;
+}
+
+/**
+ * Give back every held block, when only held blocks are left free.
+ */
+void DropReservations() {
+    int i;
+    for (i = 0; i < cache_for_inodes->stack_size; i++) {
+        ReleaseReservation(&cache_for_inodes->entries[i]);
+    }
+}
+
+/**
+ * Take a block for a regular file growing past its first block, at
+ * goal if possible.  Up to run free blocks after the one taken are held
+ * back for the file's next appends, so files growing side by side do
+ * not interleave, while one-block files still pack together.
+ */
+int AllocateFileBlock(struct inode_cache_entry *entry, int goal, int run) {
+    if (goal >= entry->reserve_start && goal < entry->reserve_end) {
+        SetBit(reserve_bitmap, goal, 0);
+        entry->reserve_start = goal + 1;
+        return AllocateBlock(goal, run);
+    }
+
+    ReleaseReservation(entry);
+    int block_number = AllocateBlock(goal, run);
+    if (block_number == 0) {
+        return 0;
+    }
+    entry->reserve_start = block_number + 1;
+    entry->reserve_end = block_number + 1;
+    while (entry->reserve_end < data_block_end && entry->reserve_end < block_number + run
+            && !BlockTaken(entry->reserve_end)) {
+        SetBit(reserve_bitmap, entry->reserve_end, 1);
+        entry->reserve_end++;
+    }
+    return block_number;
+}
+
+/**
+ * Free blocks not promised to delayed file blocks.
+ */
+int AvailableBlocks() {
+    return free_block_count - delayed_count;
+}
+
+/**
+ * Return a block to the free pool.
+ */
+void FreeBlock(int block_number) {
+    MarkBitmap(block_bitmap, block_number, 0);
+    free_block_count++;
+}
+
+/**
+ * Take a free inode, or 0 if there is none.
+ */
+int AllocateInode() {
+    int inum = PopFromBuffer(free_inode_list);
+    if (inum != 0) {
+        MarkBitmap(inode_bitmap, inum, 1);
+    }
+    return inum;
+}
+
+/**
+ * Return an inode to the free list.
+ */
+void FreeInode(int inum) {
+    PushToBuffer(free_inode_list, inum);
+    MarkBitmap(inode_bitmap, inum, 0);
+}
+
+/**
+ * Read the bitmaps of an image made with them.  Returns 1 if they can
+ * be trusted, 0 if the free lists must be rebuilt by a scan.
+ */
+int LoadBitmaps() {
+    first_data_block = (file_system_header->num_inodes + INODE_PER_BLOCK) / INODE_PER_BLOCK + 1;
+    data_block_end = file_system_header->num_blocks;
+    block_bitmap = malloc(BITMAP_BLOCKS(file_system_header->num_blocks) * BLOCKSIZE);
+    reserve_bitmap = calloc(BITMAP_BLOCKS(file_system_header->num_blocks), BLOCKSIZE);
+    if (file_system_header->padding[FS_MAGIC_SLOT] != FS_MAGIC) {
+        return 0;
+    }
+
+    int block_start = file_system_header->padding[FS_BLOCK_BITMAP_SLOT];
+    int inode_start = file_system_header->padding[FS_INODE_BITMAP_SLOT];
+    int block_blocks = BITMAP_BLOCKS(file_system_header->num_blocks);
+    int inode_blocks = BITMAP_BLOCKS(file_system_header->num_inodes + 1);
+    data_block_end = block_start;
+    bitmaps_on_disk = 1;
+    inode_bitmap = malloc(inode_blocks * BLOCKSIZE);
+    header_clean = file_system_header->padding[FS_CLEAN_SLOT] == 1;
+    if (!header_clean) {
+        return 0;
+    }
+
+    int i;
+    for (i = 0; i < block_blocks; i++) {
+        server_stats.sector_reads++;
+        ReadSector(block_start + i, block_bitmap + i * BLOCKSIZE);
+    }
+    for (i = 0; i < inode_blocks; i++) {
+        server_stats.sector_reads++;
+        ReadSector(inode_start + i, inode_bitmap + i * BLOCKSIZE);
+    }
+    return 1;
+}
+
+/**
+ * Count the free blocks in the block bitmap.
+ */
+void CountFreeBlocks() {
+    free_block_count = 0;
+    alloc_cursor = first_data_block;
+
+    int i;
+    for (i = first_data_block; i < data_block_end; i++) {
+        if (!TestBitmap(block_bitmap, i)) {
+            free_block_count++;
+        }
+    }
+}
+
+/**
+ * Build the free lists from the bitmaps.
+ */
+void ReadFreeLists() {
+    CountFreeBlocks();
+    free_inode_list = StartBuffer(file_system_header->num_inodes);
+
+    int i;
+    for (i = 1; i <= file_system_header->num_inodes; i++) {
+        if (!TestBitmap(inode_bitmap, i)) {
+            PushToBuffer(free_inode_list, i);
+        }
+    }
+}
+
+struct indirect_scan {
+    int block;
+    int count; //File blocks mapped through the block
+};
+
+/**
+ * Order indirect blocks to scan by block number.
+ */
+int CompareIndirectScan(const void *a, const void *b) {
+    return ((struct indirect_scan *)a)->block - ((struct indirect_scan *)b)->block;
+}
+
+/**
+ * Mark a block found in an inode as used, ignoring numbers outside the
+ * data area.
+ */
+void MarkScanned(unsigned char *used, int block_number) {
+    if (block_number > 0 && block_number < data_block_end) {
+        SetBit(used, block_number, 1);
+    }
+}
+
+/**
+ * Read one level of index blocks in ascending order, marking what they
+ * point to.  Each block of the level maps up to span data blocks, or
+ * span inner blocks when is_double.  Index blocks found for the next
+ * level are queued in next; returns how many were queued.
+ */
+int ScanIndexLevel(unsigned char *used, struct indirect_scan *level, int count, int span,
+                   int is_double, struct indirect_scan *next) {
+    qsort(level, count, sizeof(struct indirect_scan), CompareIndirectScan);
+    int next_count = 0;
+    int pointers[PTRS_PER_BLOCK];
+    int i;
+    for (i = 0; i < count; i++) {
+        server_stats.sector_reads++;
+        ReadSector(level[i].block, pointers);
+        int blocks = level[i].count;
+        int j;
+        if (is_double) {
+            for (j = 0; j * PTRS_PER_BLOCK < blocks && j < span; j++) {
+                if (pointers[j] <= 0 || pointers[j] >= data_block_end) {
+                    continue;
+                }
+                MarkScanned(used, pointers[j]);
+                next[next_count].block = pointers[j];
+                next[next_count].count = blocks - j * PTRS_PER_BLOCK < PTRS_PER_BLOCK ?
+                                         blocks - j * PTRS_PER_BLOCK : PTRS_PER_BLOCK;
+                next_count++;
+            }
+            continue;
+        }
+        for (j = 0; j < blocks && j < span; j++) {
+            MarkScanned(used, pointers[j]);
+        }
+        if (next != NULL && blocks > span &&
+            pointers[DOUBLE_SLOT] > 0 && pointers[DOUBLE_SLOT] < data_block_end) {
+            MarkScanned(used, pointers[DOUBLE_SLOT]);
+            next[next_count].block = pointers[DOUBLE_SLOT];
+            next[next_count].count = blocks - span;
+            next_count++;
+        }
+    }
+    return next_count;
+}
+
+/**
+ * Rebuild the free lists, and the bitmaps if the image has them, by
+ * scanning the inode table.  Inode sectors are read in order into a
+ * private buffer rather than through the caches, index blocks are
+ * read afterwards a level at a time in ascending order, and the blocks
+ * seen are marked in the block bitmap.
+ */
+void ScanFreeLists() {
+    int num_inodes = file_system_header->num_inodes;
+    int inode_block_count = (num_inodes + INODE_PER_BLOCK) / INODE_PER_BLOCK;
+    int bitmap_size = BITMAP_BLOCKS(file_system_header->num_blocks) * BLOCKSIZE;
+
+    unsigned char *used = block_bitmap;
+    memset(used, 0, bitmap_size);
+    int i;
+    for (i = 0; i <= inode_block_count; i++) {
+        SetBit(used, i, 1);
+    }
+    for (i = data_block_end; i < file_system_header->num_blocks; i++) {
+        SetBit(used, i, 1);
+    }
+    if (inode_bitmap != NULL) {
+        memset(inode_bitmap, 0, BITMAP_BLOCKS(num_inodes + 1) * BLOCKSIZE);
+        SetBit(inode_bitmap, 0, 1);
+    }
+
+    free_inode_list = StartBuffer(num_inodes);
+    struct indirect_scan *indirects = malloc(num_inodes * sizeof(struct indirect_scan));
+    int indirect_count = 0;
+    struct inode sector[INODE_PER_BLOCK];
+    int block;
+    for (block = 1; block <= inode_block_count; block++) {
+        server_stats.sector_reads++;
+        ReadSector(block, sector);
+
+        int k;
+        for (k = 0; k < INODE_PER_BLOCK; k++) {
+            int inum = (block - 1) * INODE_PER_BLOCK + k;
+            struct inode *inode = &sector[k];
+            if (inum == 0 || inum > num_inodes) {
+                continue;
+            }
+            if (inode->type == INODE_FREE) {
+                PushToBuffer(free_inode_list, inum);
+                continue;
+            }
+            if (inode_bitmap != NULL) {
+                SetBit(inode_bitmap, inum, 1);
+            }
+
+            int block_count = (inode->size + BLOCKSIZE - 1) / BLOCKSIZE;
+            int j;
+            for (j = 0; j < block_count && j < NUM_DIRECT; j++) {
+                MarkScanned(used, inode->direct[j]);
+            }
+            if (block_count > NUM_DIRECT && inode->indirect > 0 && inode->indirect < data_block_end) {
+                MarkScanned(used, inode->indirect);
+                indirects[indirect_count].block = inode->indirect;
+                indirects[indirect_count].count = block_count - NUM_DIRECT;
+                indirect_count++;
+            }
+        }
+    }
+
+    struct indirect_scan *doubles = malloc(num_inodes * sizeof(struct indirect_scan));
+    struct indirect_scan *inners = malloc(file_system_header->num_blocks * sizeof(struct indirect_scan));
+    int double_count = ScanIndexLevel(used, indirects, indirect_count, indirect_span, 0,
+                                      double_indirect ? doubles : NULL);
+    int inner_count = ScanIndexLevel(used, doubles, double_count, PTRS_PER_BLOCK, 1, inners);
+    ScanIndexLevel(used, inners, inner_count, PTRS_PER_BLOCK, 0, NULL);
+    free(indirects);
+    free(doubles);
+    free(inners);
+
+    CountFreeBlocks();
+    bitmaps_dirty = bitmaps_on_disk;
+}
+
+/**
+ * Write changed bitmaps, then mark the header clean.  The header block
+ * itself goes out with the dirty inodes.
+ */
+void SyncBitmaps() {
+    if (!bitmaps_on_disk || (!bitmaps_dirty && header_clean)) {
+        return;
+    }
+
+    int block_start = file_system_header->padding[FS_BLOCK_BITMAP_SLOT];
+    int inode_start = file_system_header->padding[FS_INODE_BITMAP_SLOT];
+    int i;
+    for (i = 0; i < BITMAP_BLOCKS(file_system_header->num_blocks); i++) {
+        Trace(TRACE_SECTOR_WRITE, 0, block_start + i);
+        server_stats.sector_writes++;
+        WriteSector(block_start + i, block_bitmap + i * BLOCKSIZE);
+    }
+    for (i = 0; i < BITMAP_BLOCKS(file_system_header->num_inodes + 1); i++) {
+        Trace(TRACE_SECTOR_WRITE, 0, inode_start + i);
+        server_stats.sector_writes++;
+        WriteSector(inode_start + i, inode_bitmap + i * BLOCKSIZE);
+    }
+    bitmaps_dirty = 0;
+    SetHeaderClean(1);
+}
+
+/*
+ * Create new file inode, placing its blocks near goal.
+ */
+struct inode* MakeFileInode(int new_inum, int parent_inum, short type, int goal) {
+    struct inode_cache_entry *inode_entry = SearchForInode(new_inum);
+    struct inode *inode = inode_entry->inode;
+    DirtyInode(inode_entry);
+    inode_entry->alloc_goal = goal;
+    inode->type = type;
+    inode->size = 0;
+    inode->nlink = 0;
+    inode->reuse++;
+
+    if (type == INODE_DIRECTORY) {
+        inode->nlink = 1; 
+        inode->size = sizeof(struct dir_entry) * 2;
+        inode->direct[0] = AllocateBlock(goal, 1);
+
+        struct dir_entry *block = ZeroBlock(inode->direct[0])->block;
+        block[0].inum = new_inum;
+        block[1].inum = parent_inum;
+        SetDirectoryName(block[0].name, ".", 0, 1);
+        SetDirectoryName(block[1].name, "..", 0, 2);
+    }
+
+    return inode;
+}
+
+/*
+ * Truncate the File inode.
+ */
+struct inode* ShortenInode(int target_inum) {
+    struct inode_cache_entry *entry = SearchForInode(target_inum);
+    struct inode *inode = entry->inode;
+
+    entry = SearchForInode(target_inum);
+    DirtyInode(entry);
+    inode = entry->inode;
+    ReleaseReservation(entry);
+    DiscardDelayed(target_inum);
+    FreeFileBlocks(inode, 0);
+
+    inode->size = 0;
+    return inode;
+}
+
+/*****************
+ * Block Mapping *
+ *****************/
+
+/*
+ * Block i of a file is direct[i] for i < NUM_DIRECT, then one of the
+ * indirect_span pointers in the indirect block.  On images formatted
+ * with FS_FORMAT_DOUBLE the indirect block's DOUBLE_SLOT names a
+ * double-indirect block instead of data, and each of its pointers names
+ * an inner block of PTRS_PER_BLOCK data pointers.  Index blocks are
+ * read through the block cache like any other block and are looked up
+ * again on every call rather than held across other cache lookups,
+ * since their slots may be recycled.
+ */
+
+/**
+ * Set the block mapping format from the header.
+ */
+void LoadFormat() {
+    if (file_system_header->padding[FS_MAGIC_SLOT] == FS_MAGIC &&
+        file_system_header->padding[FS_FORMAT_SLOT] == FS_FORMAT_DOUBLE) {
+        double_indirect = 1;
+        indirect_span = PTRS_PER_BLOCK - 1;
+    }
+    int max_blocks = NUM_DIRECT + indirect_span;
+    if (double_indirect) {
+        max_blocks += PTRS_PER_BLOCK * PTRS_PER_BLOCK;
+    }
+    max_file_size = max_blocks * BLOCKSIZE;
+}
+
+/**
+ * Index block holding the pointer to block index of a file, past the
+ * direct blocks, with the pointer's position in *slot; NULL if that
+ * index block does not exist.
+ */
+struct block_cache_entry *IndexBlockFor(struct inode *inode, int index, int *slot) {
+    if (inode->indirect == 0) {
+        return NULL;
+    }
+    struct block_cache_entry *holder = SearchForBlock(inode->indirect);
+    index -= NUM_DIRECT;
+    if (index < indirect_span) {
+        *slot = index;
+        return holder;
+    }
+
+    if (!double_indirect) {
+        return NULL;
+    }
+    index -= indirect_span;
+    int double_block = ((int *)holder->block)[DOUBLE_SLOT];
+    if (double_block == 0) {
+        return NULL;
+    }
+    int inner_block = ((int *)SearchForBlock(double_block)->block)[index / PTRS_PER_BLOCK];
+    if (inner_block == 0) {
+        return NULL;
+    }
+    *slot = index % PTRS_PER_BLOCK;
+    return SearchForBlock(inner_block);
+}
+
+/*
+ * Block number of the index'th block of a file, or 0 if unallocated.
+ */
+int GetBlockNumber(struct inode *inode, int index) {
+    if (index < NUM_DIRECT) {
+        return inode->direct[index];
+    }
+    int slot;
+    struct block_cache_entry *holder = IndexBlockFor(inode, index, &slot);
+    if (holder == NULL) {
+        return 0;
+    }
+    return ((int *)holder->block)[slot];
+}
+
+/**
+ * Cache entry owning a cached inode: the one at the same place in the
+ * entries array as the inode in the arena.
+ */
+struct inode_cache_entry *CachedEntryFor(struct inode *inode) {
+    return &cache_for_inodes->entries[inode - cache_for_inodes->arena];
+}
+
+/**
+ * Block number of block index of the file cached in entry, or 0 if
+ * unallocated.  Past the direct blocks the entry keeps a copy of the
+ * index block it last looked in, so a file read or written in order
+ * looks each index block up once rather than once per data block.
+ */
+int MapFileBlock(struct inode_cache_entry *entry, int index) {
+    struct inode *inode = entry->inode;
+    if (index < NUM_DIRECT) {
+        return inode->direct[index];
+    }
+    if (index >= entry->map_first && index < entry->map_first + entry->map_count) {
+        server_stats.map_hits++;
+        return entry->map[index - entry->map_first];
+    }
+
+    server_stats.map_misses++;
+    int slot;
+    struct block_cache_entry *holder = IndexBlockFor(inode, index, &slot);
+    if (holder == NULL) {
+        return 0;
+    }
+    entry->map_first = index - slot;
+    entry->map_count = index < NUM_DIRECT + indirect_span ? indirect_span : PTRS_PER_BLOCK;
+    memcpy(entry->map, holder->block, entry->map_count * sizeof(int));
+    return entry->map[slot];
+}
+
+/**
+ * Point block index of a file at block_number, and its cached entry's
+ * map if that covers index.  Its index blocks must exist; the caller
+ * marks the inode dirty.
+ */
+void SetBlockNumber(struct inode *inode, int index, int block_number) {
+    if (index < NUM_DIRECT) {
+        inode->direct[index] = block_number;
+        return;
+    }
+    int slot;
+    struct block_cache_entry *holder = IndexBlockFor(inode, index, &slot);
+    ((int *)holder->block)[slot] = block_number;
+    DirtyBlock(holder);
+
+    struct inode_cache_entry *entry = CachedEntryFor(inode);
+    if (index >= entry->map_first && index < entry->map_first + entry->map_count) {
+        entry->map[index - entry->map_first] = block_number;
+    }
+}
+
+/**
+ * Number of index blocks a file lacks for its blocks start_index to
+ * end_index.
+ */
+int MissingIndexBlocks(struct inode *inode, int start_index, int end_index) {
+    int first_double = NUM_DIRECT + indirect_span;
+    if (end_index < NUM_DIRECT) {
+        return 0;
+    }
+    int missing = inode->indirect == 0;
+    if (!double_indirect || end_index < first_double) {
+        return missing;
+    }
+
+    int double_block = 0;
+    if (inode->indirect != 0) {
+        double_block = ((int *)SearchForBlock(inode->indirect)->block)[DOUBLE_SLOT];
+    }
+    int first_group = start_index > first_double ? (start_index - first_double) / PTRS_PER_BLOCK : 0;
+    int last_group = (end_index - first_double) / PTRS_PER_BLOCK;
+    if (double_block == 0) {
+        return missing + 1 + last_group - first_group + 1;
+    }
+    int *groups = SearchForBlock(double_block)->block;
+    int group;
+    for (group = first_group; group <= last_group; group++) {
+        missing += groups[group] == 0;
+    }
+    return missing;
+}
+
+/**
+ * Allocate an index block near goal: from the file's reservation when
+ * entry is given, else a single block.
+ */
+int AllocateIndexBlock(struct inode_cache_entry *entry, int goal, int run) {
+    int block_number = entry != NULL ? AllocateFileBlock(entry, goal, run) : AllocateBlock(goal, 1);
+    ZeroBlock(block_number);
+    return block_number;
+}
+
+/**
+ * Give block index of a file any index blocks it lacks, each placed
+ * just ahead of the next.  Returns the goal for the data block.
+ */
+int MapIndexBlocks(struct inode_cache_entry *entry, struct inode *inode, int index, int goal, int run) {
+    if (index < NUM_DIRECT) {
+        return goal;
+    }
+    if (inode->indirect == 0) {
+        inode->indirect = AllocateIndexBlock(entry, goal, run);
+        goal = inode->indirect + 1;
+    }
+    if (index < NUM_DIRECT + indirect_span) {
+        return goal;
+    }
+
+    struct block_cache_entry *holder = SearchForBlock(inode->indirect);
+    int double_block = ((int *)holder->block)[DOUBLE_SLOT];
+    if (double_block == 0) {
+        double_block = AllocateIndexBlock(entry, goal, run);
+        goal = double_block + 1;
+        holder = SearchForBlock(inode->indirect);
+        ((int *)holder->block)[DOUBLE_SLOT] = double_block;
+        DirtyBlock(holder);
+    }
+
+    int group = (index - NUM_DIRECT - indirect_span) / PTRS_PER_BLOCK;
+    holder = SearchForBlock(double_block);
+    if (((int *)holder->block)[group] == 0) {
+        int inner_block = AllocateIndexBlock(entry, goal, run);
+        goal = inner_block + 1;
+        holder = SearchForBlock(double_block);
+        ((int *)holder->block)[group] = inner_block;
+        DirtyBlock(holder);
+    }
+    return goal;
+}
+
+/**
+ * Free the pointers[from..to) that are set, clearing them.
+ */
+void FreePointers(int *pointers, int from, int to) {
+    int i;
+    for (i = from; i < to; i++) {
+        if (pointers[i] != 0) {
+            FreeBlock(pointers[i]);
+            pointers[i] = 0;
+        }
+    }
+}
+
+/**
+ * Copy an index block's pointers out, so blocks can be freed while
+ * they are walked.
+ */
+void ReadPointers(int block_number, int *pointers) {
+    memcpy(pointers, SearchForBlock(block_number)->block, BLOCKSIZE);
+}
+
+/**
+ * Copy changed pointers back into an index block.
+ */
+void WritePointers(int block_number, int *pointers) {
+    struct block_cache_entry *holder = SearchForBlock(block_number);
+    memcpy(holder->block, pointers, BLOCKSIZE);
+    DirtyBlock(holder);
+}
+
+/**
+ * Free the blocks of a double-indirect tree mapping file blocks from
+ * on, out of count, with the inner blocks left empty.  Returns 1 if
+ * the whole tree went.
+ */
+int FreeDoubleBlocks(int double_block, int from, int count) {
+    int groups[PTRS_PER_BLOCK];
+    int pointers[PTRS_PER_BLOCK];
+    ReadPointers(double_block, groups);
+
+    int group;
+    for (group = from / PTRS_PER_BLOCK; group * PTRS_PER_BLOCK < count; group++) {
+        if (groups[group] == 0) {
+            continue;
+        }
+        int low = from - group * PTRS_PER_BLOCK;
+        int high = count - group * PTRS_PER_BLOCK;
+        if (low < 0) low = 0;
+        if (high > PTRS_PER_BLOCK) high = PTRS_PER_BLOCK;
+
+        ReadPointers(groups[group], pointers);
+        FreePointers(pointers, low, high);
+        if (low == 0) {
+            FreeBlock(groups[group]);
+            groups[group] = 0;
+        } else {
+            WritePointers(groups[group], pointers);
+        }
+    }
+
+    if (from == 0) {
+        FreeBlock(double_block);
+        return 1;
+    }
+    WritePointers(double_block, groups);
+    return 0;
+}
+
+/**
+ * Free the blocks of a file from block keep on, and the index blocks
+ * they leave empty, clearing their pointers.  The caller sets the new
+ * size.
+ */
+void FreeFileBlocks(struct inode *inode, int keep) {
+    CachedEntryFor(inode)->map_count = 0;
+
+    int block_count = (inode->size + BLOCKSIZE - 1) / BLOCKSIZE;
+    FreePointers(inode->direct, keep, block_count < NUM_DIRECT ? block_count : NUM_DIRECT);
+    if (inode->indirect == 0) {
+        return;
+    }
+
+    int pointers[PTRS_PER_BLOCK];
+    ReadPointers(inode->indirect, pointers);
+    int first_double = NUM_DIRECT + indirect_span;
+    if (double_indirect && pointers[DOUBLE_SLOT] != 0 && block_count > first_double) {
+        int from = keep > first_double ? keep - first_double : 0;
+        if (FreeDoubleBlocks(pointers[DOUBLE_SLOT], from, block_count - first_double)) {
+            pointers[DOUBLE_SLOT] = 0;
+        }
+    }
+
+    int from = keep > NUM_DIRECT ? keep - NUM_DIRECT : 0;
+    int to = block_count - NUM_DIRECT < indirect_span ? block_count - NUM_DIRECT : indirect_span;
+    FreePointers(pointers, from, to);
+    if (keep <= NUM_DIRECT) {
+        FreeBlock(inode->indirect);
+        inode->indirect = 0;
+    } else {
+        WritePointers(inode->indirect, pointers);
+    }
+}
+
+/*
+ * Block number of the last block of a file, or 0 if it has none.
+ */
+int LastBlock(struct inode *inode) {
+    if (inode->size == 0) {
+        return 0;
+    }
+    return GetBlockNumber(inode, (inode->size - 1) / BLOCKSIZE);
+}
+
+/**********************
+ * Delayed Allocation *
+ **********************/
+
+/*
+ * A block appended to a regular file first gets only a zeroed cache
+ * slot, numbered DELAYED_BLOCK and found by file and block index, and
+ * pinned so it is never evicted; the file's pointer stays 0 meanwhile,
+ * so the inode on disk never names a block it does not own.  The slots
+ * get disk blocks, each file's as one run after its last block, when
+ * the cache is synced or flushed, a write reaches the indirect block or
+ * DELAYED_MAX slots are held.  A file truncated or deleted first never
+ * gets blocks for them.
+ *
+ * A 0 pointer with no delayed slot is a hole and reads as zeros.  A
+ * delayed slot that a write fills with zeros is dropped, leaving a hole.
+ */
+
+/**
+ * Cache slot of block index of a file, whether or not it has a disk
+ * block yet, or NULL for a hole.
+ */
+struct block_cache_entry *SearchForFileBlock(struct inode_cache_entry *entry, int index) {
+    int block_num = MapFileBlock(entry, index);
+    if (block_num != 0) {
+        return SearchForBlock(block_num);
+    }
+    if (delayed_count == 0) {
+        return NULL;
+    }
+    struct block_cache_entry *block_entry = LookupDelayed(cache_for_blocks, entry->inum, index);
+    if (block_entry != NULL) {
+        TouchBlock(cache_for_blocks, block_entry);
+    }
+    return block_entry;
+}
+
+/**
+ * Whether block index of a file has a disk block or a delayed slot,
+ * without reading it.
+ */
+int HasFileBlock(struct inode_cache_entry *entry, int index) {
+    if (MapFileBlock(entry, index) != 0) {
+        return 1;
+    }
+    return delayed_count > 0 && LookupDelayed(cache_for_blocks, entry->inum, index) != NULL;
+}
+
+/**
+ * Give block index of a file a zeroed cache slot and no disk block.
+ */
+void DelayFileBlock(int inum, int index) {
+    struct block_cache_entry *entry = AddToBlockCache(cache_for_blocks, DELAYED_BLOCK, 0);
+    UnhashBlock(cache_for_blocks, entry);
+    entry->delayed_inum = inum;
+    entry->delayed_index = index;
+    HashBlock(cache_for_blocks, entry);
+    memset(entry->block, 0, BLOCKSIZE);
+    DirtyBlock(entry);
+    entry->pins++;
+    delayed_count++;
+}
+
+/**
+ * Give up a delayed slot, leaving a hole.
+ */
+void DropDelayed(struct block_cache_entry *entry) {
+    ForgetBlock(cache_for_blocks, entry);
+    entry->pins--;
+    delayed_count--;
+}
+
+/**
+ * Drop the delayed blocks of a file being truncated.
+ */
+void DiscardDelayed(int inum) {
+    int i;
+    for (i = 0; i < cache_for_blocks->stack_size && delayed_count > 0; i++) {
+        struct block_cache_entry *entry = &cache_for_blocks->entries[i];
+        if (entry->block_number == DELAYED_BLOCK && entry->delayed_inum == inum) {
+            DropDelayed(entry);
+        }
+    }
+}
+
+/**
+ * Free the blocks a write gave a file past its size, up to block end,
+ * when the client's data ran out before they were filled.
+ */
+void TrimFileBlocks(struct inode_cache_entry *entry, int end) {
+    struct inode *inode = entry->inode;
+    int keep = (inode->size + BLOCKSIZE - 1) / BLOCKSIZE;
+    int i;
+    for (i = keep; i <= end && delayed_count > 0; i++) {
+        struct block_cache_entry *slot = LookupDelayed(cache_for_blocks, entry->inum, i);
+        if (slot != NULL) {
+            DropDelayed(slot);
+        }
+    }
+
+    int size = inode->size;
+    inode->size = (end + 1) * BLOCKSIZE;
+    FreeFileBlocks(inode, keep);
+    inode->size = size;
+    DirtyInode(entry);
+}
+
+/**
+ * Whether a block buffer holds only zeros, checked a word at a time.
+ * Cache buffers are sector aligned.
+ */
+int IsZeroBlock(char *block) {
+    unsigned long *words = (unsigned long *)block;
+    unsigned long bits = 0;
+    int i;
+    for (i = 0; i < (int)(BLOCKSIZE / sizeof(unsigned long)); i++) {
+        bits |= words[i];
+    }
+    return bits == 0;
+}
+
+/**
+ * Block to place block index of a file after: one past the nearest of
+ * the PTRS_PER_BLOCK earlier blocks with a disk block, else the file's
+ * placement hint.
+ */
+int FileBlockGoal(struct inode_cache_entry *entry, int index) {
+    int i;
+    for (i = index - 1; i >= 0 && i >= index - PTRS_PER_BLOCK; i--) {
+        int block_num = MapFileBlock(entry, i);
+        if (block_num != 0) {
+            return block_num + 1;
+        }
+    }
+    return entry->alloc_goal;
+}
+
+/**
+ * Give block index of a file a disk block near goal and point the file
+ * at it.  count is how many blocks are being placed from here on, and
+ * sets the length of free run looked for; a growing file looks for a
+ * run in proportion to its size so its appends stay together.  Index
+ * blocks the block needs are placed just ahead of it.
+ */
+int PlaceFileBlock(struct inode_cache_entry *entry, int index, int goal, int count) {
+    int run = count;
+    if (index > 0 && run < index) {
+        run = index < ALLOC_RUN_MAX ? index : ALLOC_RUN_MAX;
+    }
+    if (index > 0 && run < ALLOC_RUN) {
+        run = ALLOC_RUN;
+    }
+
+    goal = MapIndexBlocks(entry, entry->inode, index, goal, run + 1);
+
+    int block_number;
+    if (index == 0) {
+        block_number = AllocateBlock(goal, run);
+    } else {
+        block_number = AllocateFileBlock(entry, goal, run);
+    }
+
+    SetBlockNumber(entry->inode, index, block_number);
+    DirtyInode(entry);
+    return block_number;
+}
+
+/**
+ * Order delayed slots by block index.
+ */
+int CompareDelayedIndex(const void *a, const void *b) {
+    const struct block_cache_entry *x = *(struct block_cache_entry * const *)a;
+    const struct block_cache_entry *y = *(struct block_cache_entry * const *)b;
+    return x->delayed_index - y->delayed_index;
+}
+
+/**
+ * Give every delayed block a disk block, file by file.
+ */
+void AllocateDelayed() {
+    while (delayed_count > 0) {
+        struct block_cache_entry **slots = cache_for_blocks->scratch;
+        int slot_count = 0;
+        int inum = -1;
+        int i;
+        for (i = 0; i < cache_for_blocks->stack_size; i++) {
+            struct block_cache_entry *entry = &cache_for_blocks->entries[i];
+            if (entry->block_number == DELAYED_BLOCK && (inum < 0 || entry->delayed_inum == inum)) {
+                inum = entry->delayed_inum;
+                slots[slot_count++] = entry;
+            }
+        }
+        qsort(slots, slot_count, sizeof(struct block_cache_entry *), CompareDelayedIndex);
+
+        struct inode_cache_entry *inode_entry = SearchForInode(inum);
+        int goal = FileBlockGoal(inode_entry, slots[0]->delayed_index);
+        for (i = 0; i < slot_count; i++) {
+            delayed_count--;
+            int block_number = PlaceFileBlock(inode_entry, slots[i]->delayed_index, goal, slot_count - i);
+            struct block_cache_entry *stale = LookupBlock(cache_for_blocks, block_number);
+            if (stale != NULL) {
+                ForgetBlock(cache_for_blocks, stale);
+            }
+            RehashBlock(cache_for_blocks, slots[i], block_number);
+            slots[i]->pins--;
+            goal = block_number + 1;
+        }
+    }
+}
+
+/*******************
+ * Directory Index *
+ *******************/
+
+/*
+ * An indexed directory is still a plain stream of dir_entry blocks.
+ * Block 0 keeps "." and "..", and its other entries, all with inum 0 so
+ * readers skip them, hold an extendible hash table: a magic name and the
+ * global depth, then 2^depth one-byte slots giving the directory block
+ * (bucket) for each value of the low depth bits of DirectoryHash(name).
+ * A bucket's local depth is implied by how many slots share it.  The
+ * other blocks are buckets of DIR_PER_BLOCK entries, so a lookup reads
+ * block 0 and one bucket whatever the directory's size.  A full bucket
+ * that cannot be split, because the index is at INDEX_DEPTH_MAX or no
+ * slot could name a new bucket, spills into overflow blocks: plain
+ * blocks no slot names, filled and searched linearly, so an indexed
+ * directory holds as many entries as a plain one.
+ */
+
+/**
+ * Hash of a name within an indexed directory.  Part of the disk format.
+ */
+unsigned int DirectoryHash(char *name) {
+    unsigned int hash = (unsigned int)NameHash(0, name) * 2654435761u;
+    return hash ^ (hash >> 16);
+}
+
+/**
+ * Whether a directory carries a hashed index in its first block.
+ */
+int IsIndexedDirectory(struct inode *inode) {
+    if (inode->size < 2 * BLOCKSIZE) {
+        return 0;
+    }
+    struct dir_entry *block = SearchForBlock(inode->direct[0])->block;
+    return block[INDEX_ENTRY].inum == 0 &&
+        memcmp(block[INDEX_ENTRY].name, INDEX_MAGIC, INDEX_MAGIC_LEN) == 0;
+}
+
+/**
+ * Copy the index slots out of block 0 and return the global depth.
+ */
+int LoadIndex(struct inode *inode, unsigned char *slots) {
+    struct dir_entry *block = SearchForBlock(inode->direct[0])->block;
+    int depth = block[INDEX_ENTRY].name[INDEX_MAGIC_LEN];
+    int k;
+    for (k = 0; k < (1 << depth); k++) {
+        slots[k] = block[INDEX_ENTRY + 1 + k / DIRNAMELEN].name[k % DIRNAMELEN];
+    }
+    return depth;
+}
+
+/**
+ * Write the index slots and global depth into block 0.
+ */
+void StoreIndex(struct inode *inode, int depth, unsigned char *slots) {
+    struct block_cache_entry *block_entry = SearchForBlock(inode->direct[0]);
+    struct dir_entry *block = block_entry->block;
+    DirtyBlock(block_entry);
+
+    int k;
+    for (k = INDEX_ENTRY; k < DIR_PER_BLOCK; k++) {
+        block[k].inum = 0;
+    }
+    memcpy(block[INDEX_ENTRY].name, INDEX_MAGIC, INDEX_MAGIC_LEN);
+    block[INDEX_ENTRY].name[INDEX_MAGIC_LEN] = depth;
+    for (k = 0; k < (1 << depth); k++) {
+        block[INDEX_ENTRY + 1 + k / DIRNAMELEN].name[k % DIRNAMELEN] = slots[k];
     }
 }
 
 /**
- * Search for block in cache.
+ * Give block index of a directory a zeroed block after its last one,
+ * with any index blocks it needs.  Returns the block's cache slot, or
+ * NULL if the disk is full.
  */
-struct block_cache_entry* FindBlockInCache(struct block_cache *cache, int block_number) {
-    struct block_cache_entry* block;
-    block = cache->hash_set[HashIndex(block_number)];
-    while (block != NULL) {
-        if (block->block_number == block_number) {
-            PopToFrontBlock(cache, block);
-            return block;
-        }
-        block = block->next_hash;
+struct block_cache_entry *MapDirectoryBlock(struct inode *inode, int index) {
+    if (AvailableBlocks() < 1 + MissingIndexBlocks(inode, index, index)) {
+        return NULL;
     }
-    return NULL;
+
+    int goal = MapIndexBlocks(NULL, inode, index, LastBlock(inode) + 1, 1);
+    int block_number = AllocateBlock(goal, 1);
+    SetBlockNumber(inode, index, block_number);
+    return ZeroBlock(block_number);
 }
 
 /**
- * Pop block and place at top of cache.
+ * Append a zeroed block to a directory.  Returns its index in the
+ * directory, or -1 if the directory or the disk is full.
  */
-void PopToFrontBlock(struct block_cache *cache, struct block_cache_entry* recent_access) {
-    bool compare_bns = recent_access->block_number == cache->top->block_number;
-    bool compare_lrus = recent_access->prev_lru == NULL && recent_access->next_lru == NULL;
-    if (compare_bns || compare_lrus) {
-        return;
+int AddDirectoryBlock(struct inode *inode) {
+    int index = inode->size / BLOCKSIZE;
+    if (inode->size + BLOCKSIZE > max_file_size || MapDirectoryBlock(inode, index) == NULL) {
+        return -1;
     }
-    if (recent_access->block_number == cache->base->block_number) {
-        recent_access->prev_lru->next_lru = NULL;
-        cache->base = recent_access->prev_lru;
-
-        recent_access->next_lru = cache->top;
-        cache->top->prev_lru = recent_access;
-        cache->top = recent_access;
-    } else {
-        recent_access->next_lru->prev_lru = recent_access->prev_lru;
-        recent_access->prev_lru->next_lru = recent_access->next_lru;
 
-        recent_access->next_lru = cache->top;
-        cache->top->prev_lru = recent_access;
-        cache->top = recent_access;
-    }
+    inode->size += BLOCKSIZE;
+    return index;
 }
 
-
 /**
- * Search for block.
+ * Turn a plain directory whose single block is full into an indexed
+ * one: its entries move to a first bucket and block 0 takes the index.
  */
-struct block_cache_entry* SearchForBlock(int block_num) {
-    struct block_cache_entry *current = FindBlockInCache(cache_for_blocks,block_num);
-    if (current != NULL) {
-        return current;
+int ConvertDirectory(struct inode *inode) {
+    struct dir_entry moving[DIR_PER_BLOCK - INDEX_ENTRY];
+    struct dir_entry *block = SearchForBlock(inode->direct[0])->block;
+    memcpy(moving, block + INDEX_ENTRY, sizeof(moving));
+
+    int bucket = AddDirectoryBlock(inode);
+    if (bucket < 0) {
+        return -1;
     }
+    struct block_cache_entry *block_entry = SearchForBlock(GetBlockNumber(inode, bucket));
+    memcpy(block_entry->block, moving, sizeof(moving));
 
-    void *block_buf = malloc(SECTORSIZE);
-    ReadSector(block_num, block_buf);
-    AddToBlockCache(cache_for_blocks, block_buf, block_num);
-    return cache_for_blocks->top;
+    unsigned char slots[1];
+    slots[0] = bucket;
+    StoreIndex(inode, 0, slots);
+    return 0;
 }
 
-/*
- * Hash the index at the key value
+/**
+ * Split a full bucket on its next hash bit, doubling the index first
+ * if the bucket already uses every bit of it.  Index slots are bytes,
+ * so no bucket may sit past directory block INDEX_BUCKETS_MAX.
  */
-int HashIndex(int key_value) {
-    if (key_value > 0) {
-        return key_value/8;
-    } else {
-        return key_value/(-8);
+int SplitBucket(struct inode *inode, int bucket) {
+    if (inode->size / BLOCKSIZE > INDEX_BUCKETS_MAX) {
+        return -1;
     }
-}
+    unsigned char slots[1 << INDEX_DEPTH_MAX];
+    int depth = LoadIndex(inode, slots);
 
-/*
- * Compare dirnames.
- */
-int CompareDirname(char *dirname, char *other);
+    int sharing = 0;
+    int k;
+    for (k = 0; k < (1 << depth); k++) {
+        if (slots[k] == bucket) sharing++;
+    }
+    int local = depth;
+    while ((1 << (depth - local)) < sharing) {
+        local--;
+    }
 
-/*
- * Compare dirnames.
- */
- int CompareDirname(char *dirname, char *other) {
-     int i;
-     for (i = 0; i < DIRNAMELEN; i++) {
-         if (dirname[i] != other[i]) {
+    if (local == depth) {
+        if (depth == INDEX_DEPTH_MAX) {
             return -1;
-         }
+        }
+        memcpy(slots + (1 << depth), slots, 1 << depth);
+        depth++;
+    }
 
-        if (dirname[i] == '\0') {
-            break;
+    int new_bucket = AddDirectoryBlock(inode);
+    if (new_bucket < 0) {
+        return -1;
+    }
+    for (k = 0; k < (1 << depth); k++) {
+        if (slots[k] == bucket && ((k >> local) & 1)) {
+            slots[k] = new_bucket;
         }
-     }
+    }
+    StoreIndex(inode, depth, slots);
+
+    struct dir_entry moving[DIR_PER_BLOCK];
+    int count = 0;
+    struct block_cache_entry *block_entry = SearchForBlock(GetBlockNumber(inode, bucket));
+    struct dir_entry *block = block_entry->block;
+    for (k = 0; k < DIR_PER_BLOCK; k++) {
+        if (block[k].inum != 0 && ((DirectoryHash(block[k].name) >> local) & 1)) {
+            moving[count++] = block[k];
+            block[k].inum = 0;
+        }
+    }
+    DirtyBlock(block_entry);
 
-     return 0;
- }
+    block_entry = SearchForBlock(GetBlockNumber(inode, new_bucket));
+    memcpy(block_entry->block, moving, count * DIRSIZE);
+    return 0;
+}
 
 /**
- * Search for value in array and swap with value at index.
+ * The bucket that holds dirname in an indexed directory, or 0 if it is
+ * "." or "..", which stay in block 0.
  */
-void SwapArrayValue(int arr[], int size, int value, int index) {
-    int i = -1;
-    int search_index = -1;
-    while (i != value && index < size) {
-        search_index++;
-        i = arr[search_index];
-    }
-    if (search_index == index || i == -1 || i > size) {
-        return;
+int IndexBucket(struct inode *inode, char *dirname) {
+    struct dir_entry *block = SearchForBlock(inode->direct[0])->block;
+    int k;
+    for (k = 0; k < INDEX_ENTRY; k++) {
+        if (CompareDirname(block[k].name, dirname) == 0) {
+            return 0;
+        }
     }
-    int j = arr[index];
-    arr[index] = value;
-    arr[search_index] = j;
+
+    int depth = block[INDEX_ENTRY].name[INDEX_MAGIC_LEN];
+    int slot = DirectoryHash(dirname) & ((1 << depth) - 1);
+    return (unsigned char)block[INDEX_ENTRY + 1 + slot / DIRNAMELEN].name[slot % DIRNAMELEN];
 }
 
 /**
- * Push free inodes to buffer.
+ * Mark which directory blocks are buckets of the index.  Returns
+ * whether the directory has overflow blocks as well.
  */
-void PushFreeInodeList() {
-    free_inode_list = StartBuffer(file_system_header->num_inodes);
-    int i;
-    for (i = 1; i <= file_system_header->num_inodes; i++) {
-        struct inode_cache_entry* curr_inode = SearchForInode(i);
-        struct inode *next = curr_inode->inode;
-        if (next->type == INODE_FREE) {
-            PushToBuffer(free_inode_list, i);
+int MarkBuckets(struct inode *inode, unsigned char *is_bucket) {
+    unsigned char slots[1 << INDEX_DEPTH_MAX];
+    int depth = LoadIndex(inode, slots);
+    int buckets = 0;
+    int k;
+
+    memset(is_bucket, 0, INDEX_BUCKETS_MAX + 1);
+    for (k = 0; k < (1 << depth); k++) {
+        if (!is_bucket[slots[k]]) {
+            is_bucket[slots[k]] = 1;
+            buckets++;
         }
     }
+    return inode->size / BLOCKSIZE - 1 > buckets;
 }
 
 /**
- * Get the list of blocks that have not been allocated yet.
+ * Find an entry in the overflow blocks of an indexed directory: the one
+ * named dirname, or a free one if dirname is NULL.  Returns the cache
+ * slot of its block and sets *entry_index, or returns NULL.
  */
-void GetFreeBlockList() {
-    int inode_count = file_system_header->num_inodes + 1;
-    int inode_block_count = (inode_count + INODE_PER_BLOCK - 1) / INODE_PER_BLOCK;
+struct block_cache_entry *FindOverflowEntry(struct inode *inode, char *dirname, int *entry_index) {
+    unsigned char is_bucket[INDEX_BUCKETS_MAX + 1];
+    if (!MarkBuckets(inode, is_bucket)) {
+        return NULL;
+    }
 
-    int block_count = file_system_header->num_blocks - inode_block_count - 1;
-    int *integer_buf = malloc(block_count * sizeof(int));
-    int i;
-    for (i = 0; i < block_count; i++) {
-        integer_buf[i] = inode_block_count + i + 1;
-    }
-
-    int busy_blocks = 0;
-    for (i = 1; i <= file_system_header->num_inodes; i ++) {
-        struct inode_cache_entry* inode_entry = SearchForInode(i);
-
-        int pos = 0;
-        int j = 0;
-        while (pos < inode_entry->inode->size && j < NUM_DIRECT) {
-            SwapArrayValue(integer_buf, block_count, inode_entry->inode->direct[j], busy_blocks);
-            busy_blocks = busy_blocks + 1;
-            j = j + 1;
-            pos += BLOCKSIZE;
-        }
-
-        if (pos < inode_entry->inode->size) {
-            SwapArrayValue(integer_buf, file_system_header->num_blocks, inode_entry->inode->indirect, busy_blocks);
-            busy_blocks = busy_blocks + 1;
-            struct block_cache_entry* curr_block = SearchForBlock(inode_entry->inode->indirect);
-            int *indirect_blocks = curr_block->block;
-            j = 0;
-            while (j < 128 && pos < inode_entry->inode->size) {
-                SwapArrayValue(integer_buf, file_system_header->num_blocks, indirect_blocks[j], busy_blocks);
-                busy_blocks = busy_blocks + 1;
-                j = j + 1;
-                pos += BLOCKSIZE;
+    int index;
+    for (index = 1; index < inode->size / BLOCKSIZE; index++) {
+        if (index <= INDEX_BUCKETS_MAX && is_bucket[index]) {
+            continue;
+        }
+        struct block_cache_entry *block_entry = SearchForBlock(GetBlockNumber(inode, index));
+        struct dir_entry *block = block_entry->block;
+        int k;
+        for (k = 0; k < DIR_PER_BLOCK; k++) {
+            if (dirname == NULL ? block[k].inum == 0 :
+                    block[k].inum != 0 && CompareDirname(block[k].name, dirname) == 0) {
+                *entry_index = k;
+                return block_entry;
             }
         }
     }
+    return NULL;
+}
 
-    free_block_list = malloc(sizeof(struct integer_buf));
-    free_block_list->size = block_count;
-    free_block_list->b = integer_buf;
-    free_block_list->in = free_block_list->size;
-    free_block_list->out = 0;
-    free_block_list->empty = 0;
-    free_block_list->full = 1;
-
+/**
+ * Find dirname in an indexed directory, or 0.
+ */
+int LookupIndexed(struct inode *inode, char *dirname) {
+    int bucket = IndexBucket(inode, dirname);
+    int count = bucket == 0 ? INDEX_ENTRY : DIR_PER_BLOCK;
+    struct dir_entry *block = SearchForBlock(GetBlockNumber(inode, bucket))->block;
     int k;
-    for (k = 0; k < busy_blocks; k++) {
-        PopFromBuffer(free_block_list);
+    for (k = 0; k < count; k++) {
+        if (block[k].inum != 0 && CompareDirname(block[k].name, dirname) == 0) {
+            return block[k].inum;
+        }
+    }
+
+    if (bucket == 0) {
+        return 0;
     }
+    struct block_cache_entry *block_entry = FindOverflowEntry(inode, dirname, &k);
+    return block_entry == NULL ? 0 : ((struct dir_entry *)block_entry->block)[k].inum;
 }
 
-/*
- * Create new file inode.
+/**
+ * Add an entry to the overflow blocks of an indexed directory, appending
+ * one if they are full.  Returns 1 if the directory grew, 0 if not, or
+ * -1 if it cannot take the entry.
  */
-struct inode* MakeFileInode(int new_inum, int parent_inum, short type) {
-    struct inode_cache_entry *inode_entry = SearchForInode(new_inum);
-    struct inode *inode = inode_entry->inode;
-    inode_entry->dirty = 1;
-    inode->type = type;
-    inode->size = 0;
-    inode->nlink = 0;
-    inode->reuse++;
-
-    if (type == INODE_DIRECTORY) {
-        inode->nlink = 1; 
-        inode->size = sizeof(struct dir_entry) * 2;
-        inode->direct[0] = PopFromBuffer(free_block_list);
-
-        struct block_cache_entry *block_entry = SearchForBlock(inode->direct[0]);
-        block_entry->dirty = 1;
-        struct dir_entry *block = block_entry->block;
-        block[0].inum = new_inum;
-        block[1].inum = parent_inum;
-        SetDirectoryName(block[0].name, ".", 0, 1);
-        SetDirectoryName(block[1].name, "..", 0, 2);
+int RegisterOverflow(struct inode *inode, int new_inum, char *dirname) {
+    int grew = 0;
+    int k;
+    struct block_cache_entry *block_entry = FindOverflowEntry(inode, NULL, &k);
+    if (block_entry == NULL) {
+        int index = AddDirectoryBlock(inode);
+        if (index < 0) {
+            return -1;
+        }
+        block_entry = SearchForBlock(GetBlockNumber(inode, index));
+        k = 0;
+        grew = 1;
     }
 
-    return inode;
+    struct dir_entry *block = block_entry->block;
+    block[k].inum = new_inum;
+    SetDirectoryName(block[k].name, dirname, 0, DIRNAMELEN);
+    DirtyBlock(block_entry);
+    return grew;
 }
 
-/*
- * Truncate the File inode.
+/**
+ * Add an entry to its bucket in an indexed directory, splitting the
+ * bucket until it has room or overflowing if it cannot be split.  Returns 1 if the directory grew, 0 if not,
+ * or -1 if it cannot take the entry.
  */
-struct inode* ShortenInode(int target_inum) {
-    struct inode_cache_entry *entry = SearchForInode(target_inum);
-    struct inode *inode = entry->inode;
-
-    entry = SearchForInode(target_inum);
-    entry->dirty = 1;
-    inode = entry->inode;
-
-    int block_count = (inode->size + BLOCKSIZE - 1) / BLOCKSIZE;
-    int i;
+int RegisterIndexed(struct inode *inode, int new_inum, char *dirname) {
+    unsigned int hash = DirectoryHash(dirname);
+    int grew = 0;
+    while (1) {
+        unsigned char slots[1 << INDEX_DEPTH_MAX];
+        int depth = LoadIndex(inode, slots);
+        int bucket = slots[hash & ((1 << depth) - 1)];
 
-    int iterate_count = block_count;
-    if (block_count > NUM_DIRECT) {
-        iterate_count = NUM_DIRECT;
-        struct block_cache_entry *indirect_block_entry = SearchForBlock(inode->indirect);
-        int *indirect_block = indirect_block_entry->block;
-        indirect_block_entry->dirty = 1;
-        for (i = 0; i < block_count - NUM_DIRECT; i++) {
-            if (indirect_block[i] != 0) {
-                PushToBuffer(free_block_list, indirect_block[i]);
+        struct block_cache_entry *block_entry = SearchForBlock(GetBlockNumber(inode, bucket));
+        struct dir_entry *block = block_entry->block;
+        int k;
+        for (k = 0; k < DIR_PER_BLOCK; k++) {
+            if (block[k].inum == 0) {
+                block[k].inum = new_inum;
+                SetDirectoryName(block[k].name, dirname, 0, DIRNAMELEN);
+                DirtyBlock(block_entry);
+                return grew;
             }
         }
-        if (inode->indirect != 0) {
-            PushToBuffer(free_block_list, inode->indirect);
+
+        if (SplitBucket(inode, bucket) < 0) {
+            int overflowed = RegisterOverflow(inode, new_inum, dirname);
+            return overflowed < 0 ? -1 : grew | overflowed;
         }
+        grew = 1;
+    }
+}
+
+/**
+ * Whether a directory holds nothing but "." and "..".
+ */
+int IsDirectoryEmpty(struct inode *inode) {
+    if (!IsIndexedDirectory(inode)) {
+        return inode->size <= DIRSIZE * 2;
     }
 
-    for (i = 0; i < iterate_count; i++) {
-        if (inode->direct[i] != 0) {
-            PushToBuffer(free_block_list, inode->direct[i]);
+    int index;
+    for (index = 1; index < inode->size / BLOCKSIZE; index++) {
+        struct dir_entry *block = SearchForBlock(GetBlockNumber(inode, index))->block;
+        int k;
+        for (k = 0; k < DIR_PER_BLOCK; k++) {
+            if (block[k].inum != 0) return 0;
         }
     }
+    return 1;
+}
 
-    inode->size = 0;
-    return inode;
+int RegisterPlain(struct inode* parent_inode, int new_inum, char *dirname);
+
+/*
+ * Register inum and dirname to directory inode.  Returns 1 if the
+ * directory inode changed, 0 if not, or -1 if the directory is full.
+ */
+int RegisterDirectory(int parent_inum, struct inode* parent_inode, int new_inum, char *dirname) {
+    int changed;
+    if (IsIndexedDirectory(parent_inode)) {
+        changed = RegisterIndexed(parent_inode, new_inum, dirname);
+    } else {
+        changed = RegisterPlain(parent_inode, new_inum, dirname);
+    }
+
+    if (changed >= 0) {
+        EnterName(parent_inum, dirname, new_inum);
+    }
+    return changed;
 }
 
 /*
- * Registerinum and dirname to directory inode.
+ * Register an entry in the first free slot of a plain directory, or at
+ * its end.  With -i, a full single-block directory is converted to an
+ * indexed one instead of growing.
  */
-int RegisterDirectory(struct inode* parent_inode, int new_inum, char *dirname) {
+int RegisterPlain(struct inode* parent_inode, int new_inum, char *dirname) {
     struct block_cache_entry *block_entry;
     struct dir_entry *block;
-    int *indirect_block = NULL;
     int dir_index;
     int prev_index = -1;
     int outer_index; 
@@ -705,109 +2884,130 @@ int RegisterDirectory(struct inode* parent_inode, int new_inum, char *dirname) {
         inner_index = dir_index % DIR_PER_BLOCK;
 
         if (prev_index != outer_index) {
-            if (outer_index >= NUM_DIRECT) {
-                if (indirect_block == NULL) {
-                    indirect_block = SearchForBlock(parent_inode->indirect)->block;
-                }
-                block_entry = SearchForBlock(indirect_block[outer_index - NUM_DIRECT]);
-                block = block_entry->block;
-            } else {
-                block_entry = SearchForBlock(parent_inode->direct[outer_index]);
-                block = block_entry->block;
-            }
+            block_entry = SearchForBlock(GetBlockNumber(parent_inode, outer_index));
+            block = block_entry->block;
             prev_index = outer_index;
         }
 
         if (block[inner_index].inum == 0) {
             block[inner_index].inum = new_inum;
             SetDirectoryName(block[inner_index].name, dirname, 0, DIRNAMELEN);
-            block_entry->dirty = 1;
+            DirtyBlock(block_entry);
             return 0;
         }
     }
 
-    struct block_cache_entry *indirect_block_entry;
-    if (parent_inode->size >= MAX_DIRECT_SIZE) {
-        if (parent_inode->size == MAX_DIRECT_SIZE) {
-            parent_inode->indirect = PopFromBuffer(free_block_list);
+    if (index_directories && parent_inode->size == BLOCKSIZE) {
+        if (ConvertDirectory(parent_inode) < 0) {
+            return -1;
         }
+        return RegisterIndexed(parent_inode, new_inum, dirname) < 0 ? -1 : 1;
+    }
 
-        indirect_block_entry = SearchForBlock(parent_inode->indirect);
-        indirect_block = indirect_block_entry->block;
-
-        outer_index = (parent_inode->size - MAX_DIRECT_SIZE) / BLOCKSIZE;
-        inner_index = GET_DIR_COUNT(parent_inode->size) % DIR_PER_BLOCK;
-
-        if (inner_index == 0) {
-            indirect_block[outer_index] = PopFromBuffer(free_block_list);
-            indirect_block_entry->dirty = 1;
+    outer_index = parent_inode->size / BLOCKSIZE;
+    inner_index = GET_DIR_COUNT(parent_inode->size) % DIR_PER_BLOCK;
+    if (inner_index == 0) {
+        block_entry = MapDirectoryBlock(parent_inode, outer_index);
+        if (block_entry == NULL) {
+            return -1;
         }
-
-        block_entry = SearchForBlock(indirect_block[outer_index]);
-        block = block_entry->block;
     } else {
-        outer_index = parent_inode->size / BLOCKSIZE;
-        inner_index = GET_DIR_COUNT(parent_inode->size) % DIR_PER_BLOCK;
-        if (inner_index == 0) {
-            parent_inode->direct[outer_index] = PopFromBuffer(free_block_list);
-        }
-
-        block_entry = SearchForBlock(parent_inode->direct[outer_index]);
-        block = block_entry->block;
+        block_entry = SearchForBlock(GetBlockNumber(parent_inode, outer_index));
     }
+    block = block_entry->block;
 
     block[inner_index].inum = new_inum;
     SetDirectoryName(block[inner_index].name, dirname, 0, DIRNAMELEN);
-    block_entry->dirty = 1;
+    DirtyBlock(block_entry);
     parent_inode->size += DIRSIZE;
     return 1;
 }
 
 /*
- * Remove parent inode from directory
+ * Remove the entry for target_inum from a directory.  If dirname is
+ * given, only an entry of that name matches, so a file linked twice
+ * into the same directory loses the right name.
  */
-int UnregisterDirectory(struct inode* parent_inode, int target_inum) {
-    int *indirect_block = NULL;
+int UnregisterDirectory(int parent_inum, struct inode* parent_inode, int target_inum, char *dirname) {
     struct block_cache_entry *block_entry;
     struct dir_entry *block;
-    int dir_index;
+    int dir_index = 0;
+    int dir_count = GET_DIR_COUNT(parent_inode->size);
     int prev_index = -1;
     int outer_index;
     int inner_index;
+    int bucket = 0;
 
-    for (dir_index = 0; dir_index < GET_DIR_COUNT(parent_inode->size); dir_index++) {
+    if (dirname != NULL && IsIndexedDirectory(parent_inode)) {
+        bucket = IndexBucket(parent_inode, dirname);
+        dir_index = bucket * DIR_PER_BLOCK;
+        dir_count = dir_index + DIR_PER_BLOCK;
+    }
+
+    for (; dir_index < dir_count; dir_index++) {
         outer_index = dir_index / DIR_PER_BLOCK;
         inner_index = dir_index % DIR_PER_BLOCK;
 
         if (prev_index != outer_index) {
-            if (outer_index >= NUM_DIRECT) {
-                if (indirect_block == NULL) {
-                    indirect_block = SearchForBlock(parent_inode->indirect)->block;
-                }
-                block_entry = SearchForBlock(indirect_block[outer_index - NUM_DIRECT]);
-                block = block_entry->block;
-            } else {
-                block_entry = SearchForBlock(parent_inode->direct[outer_index]);
-                block = block_entry->block;
-            }
+            block_entry = SearchForBlock(GetBlockNumber(parent_inode, outer_index));
+            block = block_entry->block;
             prev_index = outer_index;
         }
 
-        if (block[inner_index].inum == target_inum) {
+        if (block[inner_index].inum == target_inum &&
+                (dirname == NULL || CompareDirname(block[inner_index].name, dirname) == 0)) {
             block[inner_index].inum = 0;
-            block_entry->dirty = 1;
+            DirtyBlock(block_entry);
+            EnterName(parent_inum, block[inner_index].name, 0);
             return 0;
         }
     }
 
+    if (bucket != 0) {
+        block_entry = FindOverflowEntry(parent_inode, dirname, &inner_index);
+        if (block_entry != NULL) {
+            block = block_entry->block;
+            if (block[inner_index].inum == target_inum) {
+                block[inner_index].inum = 0;
+                DirtyBlock(block_entry);
+                EnterName(parent_inum, block[inner_index].name, 0);
+                return 0;
+            }
+        }
+    }
+
     return -1;
 }
 
+int ScanDirectory(struct inode *inode, char *dirname);
+
+/*
+ * Find inode that matches dirname in directory inum, or 0.  Results,
+ * including misses, go through the name cache.
+ */
+int SearchDirectory(int inum, struct inode *inode, char *dirname) {
+    struct name_cache_entry *name_entry = FindNameInCache(inum, dirname);
+    if (name_entry != NULL) {
+        server_stats.name_hits++;
+        return name_entry->inum;
+    }
+    server_stats.name_misses++;
+    server_stats.name_ghost_hits += TakeGhost(cache_for_names->evicted, NameHash(inum, dirname));
+
+    int target_inum;
+    if (IsIndexedDirectory(inode)) {
+        target_inum = LookupIndexed(inode, dirname);
+    } else {
+        target_inum = ScanDirectory(inode, dirname);
+    }
+    EnterName(inum, dirname, target_inum);
+    return target_inum;
+}
+
 /*
- * Find inode that matches dirname.
+ * Scan the entries of a directory for dirname.
  */
-int SearchDirectory(struct inode *inode, char *dirname) {
-    int *indirect_block = NULL;
+int ScanDirectory(struct inode *inode, char *dirname) {
     struct dir_entry *block;
     int dir_index;
     int prev_index = -1;
@@ -819,14 +3019,7 @@ int SearchDirectory(struct inode *inode, char *dirname) {
         inner_index = dir_index % DIR_PER_BLOCK;
 
         if (prev_index != outer_index) {
-            if (outer_index >= NUM_DIRECT) {
-                if (indirect_block == NULL) {
-                    indirect_block = SearchForBlock(inode->indirect)->block;
-                }
-                block = SearchForBlock(indirect_block[outer_index - NUM_DIRECT])->block;
-            } else {
-                block = SearchForBlock(inode->direct[outer_index])->block;
-            }
+            block = SearchForBlock(GetBlockNumber(inode, outer_index))->block;
             prev_index = outer_index;
         }
 
@@ -840,14 +3033,17 @@ int SearchDirectory(struct inode *inode, char *dirname) {
 }
 
 /*
- * Update directory stats given directory inode.
+ * Update directory stats given directory inode.  Indexed directories
+ * keep their buckets.
  */
 int CleanDirectory(struct inode *inode) {
-    int dirty = 0;
-    struct block_cache_entry *indirect_block_entry;
+    if (IsIndexedDirectory(inode)) {
+        return 0;
+    }
+
     struct dir_entry *block;
-    int *indirect_block = NULL;
     int prev_index = -1;
+    int size = inode->size;
 
     int dir_index;
     for (dir_index = GET_DIR_COUNT(inode->size) - 1; dir_index > 0; dir_index--) {
@@ -855,43 +3051,22 @@ int CleanDirectory(struct inode *inode) {
         int inner_index = dir_index % DIR_PER_BLOCK;
 
         if (prev_index != outer_index) {
-            if (outer_index >= NUM_DIRECT) {
-                if (indirect_block == NULL) {
-                    indirect_block_entry = SearchForBlock(inode->indirect);
-                    indirect_block = indirect_block_entry->block;
-                }
-                struct block_cache_entry* temp_block = SearchForBlock(indirect_block[outer_index - NUM_DIRECT]);
-                block = temp_block->block;
-            } else {
-                struct block_cache_entry* temp_block = SearchForBlock(inode->direct[outer_index]);
-                block = temp_block->block;
-            }
-
-            if (prev_index > 0) {
-                if (prev_index >= NUM_DIRECT) {
-                    if (indirect_block[outer_index - NUM_DIRECT] != 0) {
-                        PushToBuffer(free_block_list, indirect_block[prev_index - NUM_DIRECT]);
-                    }
-
-                    if (prev_index == NUM_DIRECT && inode->indirect != 0) {
-                        PushToBuffer(free_block_list, inode->indirect);
-                    }
-                } else if (inode->direct[prev_index] != 0) {
-                    PushToBuffer(free_block_list, inode->direct[prev_index]);
-                }
-            }
+            block = SearchForBlock(GetBlockNumber(inode, outer_index))->block;
             prev_index = outer_index;
         }
 
         if (block[inner_index].inum != 0) {
             break;
         }
-
-        dirty = 1;
-        inode->size -= DIRSIZE;
+        size -= DIRSIZE;
     }
 
-    return dirty;
+    if (size == inode->size) {
+        return 0;
+    }
+    FreeFileBlocks(inode, (size + BLOCKSIZE - 1) / BLOCKSIZE);
+    inode->size = size;
+    return 1;
 }
 
 /*************************
@@ -926,7 +3101,7 @@ void SearchFile(void *packet, int pid) {
     ((FilePacket *) packet)->inum = 0;
 
     char dirname[DIRNAMELEN];
-    if (CopyFrom(pid, dirname, target, DIRNAMELEN) < 0) {
+    if (CopyFromClient(pid, dirname, target, DIRNAMELEN) < 0) {
         return;
     }
     struct inode *parent_inode = SearchForInode(inum)->inode;
@@ -934,7 +3109,7 @@ void SearchFile(void *packet, int pid) {
     if (parent_inode->type != INODE_DIRECTORY) {
         return;
     }
-    int target_inum = SearchDirectory(parent_inode, dirname);
+    int target_inum = SearchDirectory(inum, parent_inode, dirname);
 
     if (target_inum == 0) {
         return;
@@ -950,6 +3125,77 @@ void SearchFile(void *packet, int pid) {
     // return 0;
 }
 
+/**
+ * Resolve a whole pathname, copied from the client in one CopyFrom,
+ * starting from the client's current directory in arg1.  Components
+ * are split the way the library used to split them: a leading '/'
+ * starts at the root, and a trailing '/' resolves "." in the last
+ * directory.
+ */
+void ResolvePath(DataPacket *packet, int pid) {
+    int inum = packet->arg1;
+    int length = packet->arg2;
+    void *target = packet->pointer;
+
+    memset(packet, 0, PACKET_SIZE);
+    PathPacket *reply = (PathPacket *)packet;
+    reply->packet_type = MSG_RESOLVE_PATH;
+    reply->status = -2;
+
+    char path[MAXPATHNAMELEN + 1];
+    if (length <= 0 || length > MAXPATHNAMELEN || CopyFromClient(pid, path, target, length) < 0) {
+        return;
+    }
+    path[length] = '\0';
+
+    int parent_inum = inum;
+    int i = 0;
+    if (path[0] == '/') {
+        inum = ROOTINODE;
+        parent_inum = ROOTINODE;
+        i = 1;
+    }
+
+    char dirname[DIRNAMELEN];
+    int done = 0;
+    while (!done) {
+        int start = i;
+        while (path[i] != '\0' && path[i] != '/') {
+            i++;
+        }
+        if (i == start) {
+            SetDirectoryName(dirname, ".", 0, 1);
+        } else {
+            SetDirectoryName(dirname, path, start, i);
+        }
+        while (path[i] == '/') {
+            i++;
+        }
+        done = path[i] == '\0' && (i == start || path[i - 1] != '/');
+
+        struct inode *parent_inode = SearchForInode(inum)->inode;
+        parent_inum = inum;
+        inum = 0;
+        if (parent_inode->type == INODE_DIRECTORY) {
+            inum = SearchDirectory(parent_inum, parent_inode, dirname);
+        }
+        if (inum == 0) {
+            reply->status = done ? -1 : -2;
+            reply->parent_inum = parent_inum;
+            return;
+        }
+    }
+
+    struct inode *inode = SearchForInode(inum)->inode;
+    reply->status = 0;
+    reply->parent_inum = parent_inum;
+    reply->inum = inum;
+    reply->type = inode->type;
+    reply->size = inode->size;
+    reply->nlink = inode->nlink;
+    reply->reuse = inode->reuse;
+}
+
 /**
  * Create file.
 */
@@ -961,7 +3207,7 @@ void CreateFile(void *packet, int pid, short type) {
     ((FilePacket *)packet)->packet_type = MSG_CREATE_FILE;
 
     char dirname[DIRNAMELEN];
-    if (CopyFrom(pid, dirname, target, DIRNAMELEN) < 0) {
+    if (CopyFromClient(pid, dirname, target, DIRNAMELEN) < 0) {
         ((FilePacket *)packet)->inum = 0;
         return;
     }
@@ -974,32 +3220,43 @@ void CreateFile(void *packet, int pid, short type) {
         return;
     }
 
-    if (parent_inode->size >= MAX_FILE_SIZE) {
+    if (parent_inode->size >= max_file_size) {
         ((FilePacket *)packet)->inum = -2;
         return;
     }
 
-    int target_inum = SearchDirectory(parent_inode, dirname);
+    int target_inum = SearchDirectory(parent_inum, parent_inode, dirname);
     struct inode *new_inode;
     if (target_inum > 0) {
+        int goal = LastBlock(parent_inode);
         new_inode = ShortenInode(target_inum);
+        SearchForInode(target_inum)->alloc_goal = goal;
     } else {
-        if (free_inode_list->size == 0) {
+        if (free_inode_list->empty) {
             ((FilePacket *)packet)->inum = -3;
             return;
         }
-        if (free_block_list->size < 3) {
+        if (AvailableBlocks() < 3) {
             ((FilePacket *)packet)->inum = -4;
             return;
         }
 
-        target_inum = PopFromBuffer(free_inode_list);
-        new_inode = MakeFileInode(target_inum, parent_inum, type);
+        target_inum = AllocateInode();
+        int registered = RegisterDirectory(parent_inum, parent_inode, target_inum, dirname);
+        if (registered < 0) {
+            FreeInode(target_inum);
+            ((FilePacket *)packet)->inum = -2;
+            return;
+        }
+        new_inode = MakeFileInode(target_inum, parent_inum, type, LastBlock(parent_inode));
 
         if (type == INODE_DIRECTORY) {
             parent_inode->nlink += 1;
+            registered = 1;
+        }
+        if (registered) {
+            DirtyInode(parent_entry);
         }
-        parent_entry->dirty = RegisterDirectory(parent_inode, target_inum, dirname);
         new_inode->nlink = new_inode->nlink + 1;
     }
 
@@ -1010,8 +3267,113 @@ void CreateFile(void *packet, int pid, short type) {
     ((FilePacket *)packet)->reuse = new_inode->reuse;
 }
 
+/**************
+ * Read-ahead *
+ **************/
+
+int readahead_limit = 1; //Largest window, shrunk when read-ahead is wasted
+int readahead_inum = -1; //File planned for read-ahead after the reply
+int readahead_blocks[READAHEAD_LIMIT];
+int readahead_count = 0;
+
+/**
+ * A prefetched block was used: let windows grow again.
+ */
+void ReadAheadHit() {
+    if (readahead_limit < READAHEAD_MAX) {
+        readahead_limit++;
+    }
+}
+
+/**
+ * A prefetched block was evicted unused: halve the largest window.
+ */
+void ReadAheadWasted() {
+    if (readahead_limit > 1) {
+        readahead_limit /= 2;
+    }
+}
+
+/**
+ * Detect a sequential or fixed-stride pattern in reads of the file and
+ * plan which block indices to prefetch once the client has its reply.
+ */
+void PlanReadAhead(struct inode_cache_entry *entry, int pos, int size, int start_index, int end_index) {
+    int stride = start_index - entry->last_start;
+    int sequential = pos == entry->next_pos;
+    int strided = stride > 1 && stride == entry->last_stride;
+
+    entry->next_pos = pos + size;
+    entry->last_start = start_index;
+    entry->last_stride = stride;
+    readahead_count = 0;
+
+    if (!sequential && !strided) {
+        entry->window = 0;
+        entry->readahead_next = 0;
+        return;
+    }
+
+    entry->window = entry->window == 0 ? 2 : entry->window * 2;
+    if (entry->window > readahead_limit) {
+        entry->window = readahead_limit;
+    }
+
+    int last_index = (entry->inode->size - 1) / BLOCKSIZE;
+    int index;
+    if (sequential) {
+        index = end_index + 1;
+        if (index < entry->readahead_next) {
+            index = entry->readahead_next;
+        }
+        for (; index <= end_index + entry->window && index <= last_index; index++) {
+            readahead_blocks[readahead_count++] = index;
+        }
+        entry->readahead_next = index;
+    } else {
+        int k;
+        for (k = 1; k <= entry->window; k++) {
+            index = start_index + k * stride;
+            if (index > last_index) {
+                break;
+            }
+            readahead_blocks[readahead_count++] = index;
+        }
+    }
+    readahead_inum = entry->inum;
+}
+
+/**
+ * Prefetch the planned blocks.  Looking up a block past the direct
+ * blocks fills the inode's block map as well, ahead of the client.
+ */
+void ReadAhead() {
+    if (readahead_count == 0) {
+        return;
+    }
+
+    struct inode_cache_entry *inode_entry = SearchForInode(readahead_inum);
+    int i;
+    for (i = 0; i < readahead_count; i++) {
+        int block_num = MapFileBlock(inode_entry, readahead_blocks[i]);
+        if (block_num == 0 || LookupBlock(cache_for_blocks, block_num) != NULL) {
+            continue;
+        }
+
+        struct block_cache_entry *entry = AddToBlockCache(cache_for_blocks, block_num, 1);
+        NoteTransfer(block_num, 1);
+        ReadSector(block_num, entry->block);
+        server_stats.sector_reads++;
+        server_stats.readahead_reads++;
+    }
+    readahead_count = 0;
+}
+
+char staging_buf[STAGING_SIZE]; //Client data moved in one copy per STAGING_SIZE bytes
+
 /**
- * Read file from packet.
+ * Read file from packet.  The blocks are gathered into staging_buf
+ * and reach the client in one CopyTo per STAGING_SIZE bytes.
 */
 void ReadFile(DataPacket *packet, int pid) {
     int inum = packet->arg1;
@@ -1046,37 +3408,17 @@ void ReadFile(DataPacket *packet, int pid) {
     int start_index = pos / BLOCKSIZE;
     int end_index = (pos + size) / BLOCKSIZE;
     if ((pos + size) % BLOCKSIZE == 0) {
-        end_index = end_index - 1;
-    }
-
-    char hole_buf[BLOCKSIZE];
-    memset(hole_buf, 0, BLOCKSIZE);
-
-    int *indirect_block = NULL;
-
-    if (inode->size >= MAX_DIRECT_SIZE) {
-        struct block_cache_entry* temp_block = SearchForBlock(inode->indirect);
-        indirect_block = temp_block->block;
+        end_index = end_index - 1;
     }
 
+    PlanReadAhead(inode_entry, pos, size, start_index, end_index);
+
     int outer_index;
     int prefix = 0;
     int copied_size = 0;
+    int staged = 0;
     for (outer_index = start_index; outer_index <= end_index; outer_index++) {
-        int block_id;
-        char *block;
-        if (outer_index >= NUM_DIRECT) {
-            block_id = indirect_block[outer_index - NUM_DIRECT];
-        } else {
-            block_id = inode->direct[outer_index];
-        }
-
-        if (block_id != 0) {
-            block = SearchForBlock(block_id)->block;
-        }
-        else {
-            block = hole_buf;
-        }
+        struct block_cache_entry *block_entry = SearchForFileBlock(inode_entry, outer_index);
 
         prefix = (pos + copied_size) % BLOCKSIZE;
         int copysize = BLOCKSIZE - prefix;
@@ -1085,16 +3427,29 @@ void ReadFile(DataPacket *packet, int pid) {
             copysize = size - copied_size;
         }
 
-        if (copysize > 0) {
-            CopyTo(pid, integer_buf + copied_size, block + prefix, copysize);
-            copied_size += copysize;
+        if (block_entry != NULL) {
+            memcpy(staging_buf + staged, (char *)block_entry->block + prefix, copysize);
+        } else {
+            memset(staging_buf + staged, 0, copysize);
+        }
+        staged += copysize;
+        copied_size += copysize;
+
+        if (staged + BLOCKSIZE > STAGING_SIZE || outer_index == end_index) {
+            if (CopyToClient(pid, integer_buf + copied_size - staged, staging_buf, staged) < 0) {
+                packet->arg1 = -3;
+                return;
+            }
+            staged = 0;
         }
     }
     packet->arg1 = copied_size;
 }
 
 /**
- * Write file from packet.
+ * Write file from packet.  The client's data comes over into
+ * staging_buf in one CopyFrom per STAGING_SIZE bytes, the first before
+ * any block is allocated, and is then scattered into the cached blocks.
 */
 void WriteFile(DataPacket *packet, int pid) {
     int inum = packet->arg1;
@@ -1107,7 +3462,7 @@ void WriteFile(DataPacket *packet, int pid) {
     memset(packet, 0, PACKET_SIZE);
     packet->packet_type = MSG_WRITE_FILE;
 
-    if (pos + size > MAX_FILE_SIZE) {
+    if (pos + size > max_file_size) {
         packet->arg1 = -1;
         return;
     }
@@ -1125,89 +3480,68 @@ void WriteFile(DataPacket *packet, int pid) {
         return;
     }
 
+    int staged_from = 0;
+    int staged_end = size < STAGING_SIZE ? size : STAGING_SIZE;
+    if (CopyFromClient(pid, staging_buf, integer_buf, staged_end) < 0) {
+        packet->arg1 = -5;
+        return;
+    }
+
     int start_index = pos / BLOCKSIZE; 
     int end_index = (pos + size) / BLOCKSIZE; 
     if ((pos + size) % BLOCKSIZE == 0) {
         end_index = end_index - 1;
     }
 
-    struct block_cache_entry *indirect_block_entry;
-    int *indirect_block = NULL;
-    // Prefetch indirect block
-    if (inode->size >= MAX_DIRECT_SIZE) {
-        indirect_block = SearchForBlock(inode->indirect)->block;
-    }
-
     int inode_block_count = (inode->size + BLOCKSIZE - 1) / BLOCKSIZE;
 
-    int extra_blocks = 0;
+    int new_blocks = 0;
     int i;
     for (i = start_index; i <= end_index; i++) {
-        if (inode_block_count <= i) {
-            if (i == NUM_DIRECT) {
-                extra_blocks++;
-            }
-
-            if (i >= start_index) {
-                extra_blocks++;
-            }
+        if (i < inode_block_count && HasFileBlock(inode_entry, i)) {
+            continue;
         }
+        new_blocks++;
     }
+    int new_index = new_blocks > 0 ? MissingIndexBlocks(inode, start_index, end_index) : 0;
 
-    if (free_block_list->size <= extra_blocks) {
+    if (AvailableBlocks() < new_blocks + new_index) {
         ((FilePacket *)packet)->inum = -4;
         return;
     }
 
-
-    int outer_index = start_index;
-    if (outer_index < inode_block_count) {
-        outer_index = inode_block_count;
+    int delay = new_blocks <= DELAYED_MAX && new_index == 0;
+    if (new_index > 0 || (delay && delayed_count + new_blocks > DELAYED_MAX)) {
+        AllocateDelayed();
+        inode_entry = SearchForInode(inum);
+        inode = inode_entry->inode;
     }
-    for (; outer_index <= end_index; outer_index++) {
-        if (inode_block_count <= outer_index) {
-            if (outer_index == NUM_DIRECT) {
-                inode->indirect = PopFromBuffer(free_block_list);
-                indirect_block_entry = SearchForBlock(inode->indirect);
-                indirect_block = indirect_block_entry->block;
-                indirect_block_entry->dirty = 1;
-                memset(indirect_block, 0, BLOCKSIZE);
-            }
 
-            if (outer_index > NUM_DIRECT) {
-                indirect_block_entry = SearchForBlock(inode->indirect);
-                indirect_block = indirect_block_entry->block;
-                indirect_block_entry->dirty = 1;
+    int goal = 0;
+    int outer_index;
+    for (outer_index = start_index; outer_index <= end_index && new_blocks > 0; outer_index++) {
+        if (outer_index < inode_block_count && HasFileBlock(inode_entry, outer_index)) {
+            continue;
+        }
+        if (delay) {
+            DelayFileBlock(inum, outer_index);
+        } else {
+            if (goal == 0) {
+                goal = FileBlockGoal(inode_entry, outer_index);
             }
-
-            if (outer_index >= start_index) {
-                if (outer_index >= NUM_DIRECT) {
-                    indirect_block[outer_index - NUM_DIRECT] = PopFromBuffer(free_block_list);
-                    block = SearchForBlock(indirect_block[outer_index - NUM_DIRECT])->block;
-                    memset(block, 0, BLOCKSIZE);
-                } else {
-                    inode->direct[outer_index] = PopFromBuffer(free_block_list);
-                    block = SearchForBlock(inode->direct[outer_index])->block;
-                    memset(block, 0, BLOCKSIZE);
-                    inode_entry->dirty = 1;
-                }
+            int block_number = PlaceFileBlock(inode_entry, outer_index, goal, new_blocks);
+            if (outer_index == start_index || outer_index == end_index || outer_index < inode_block_count) {
+                ZeroBlock(block_number);
             }
+            goal = block_number + 1;
         }
+        new_blocks--;
     }
 
     int copied_size = 0; 
     int new_size = start_index * BLOCKSIZE;
 
     for (outer_index = start_index; outer_index <= end_index; outer_index++) {
-        int block_id;
-        if (outer_index >= NUM_DIRECT) {
-            block_id = indirect_block[outer_index - NUM_DIRECT];
-        } else {
-            block_id = inode->direct[outer_index];
-        }
-
-        struct block_cache_entry *block_entry = SearchForBlock(block_id);
-        block = block_entry->block;
         int prefix = (pos + copied_size) % BLOCKSIZE;
 
         if (outer_index == start_index) {
@@ -1219,24 +3553,50 @@ void WriteFile(DataPacket *packet, int pid) {
             copysize = size - copied_size;
         }
 
-        CopyFrom(pid, block + prefix, integer_buf + copied_size, copysize);
-        block_entry->dirty = 1;
+        if (copied_size + copysize > staged_end) {
+            staged_from = copied_size;
+            staged_end = size - copied_size < STAGING_SIZE ? size : copied_size + STAGING_SIZE;
+            if (CopyFromClient(pid, staging_buf, integer_buf + copied_size, staged_end - copied_size) < 0) {
+                packet->arg1 = -5;
+                break;
+            }
+        }
+
+        struct block_cache_entry *block_entry;
+        int block_number = MapFileBlock(inode_entry, outer_index);
+        if (copysize == BLOCKSIZE && block_number != 0) {
+            block_entry = OverwriteBlock(block_number);
+        } else {
+            block_entry = SearchForFileBlock(inode_entry, outer_index);
+        }
+        block = block_entry->block;
+
+        memcpy(block + prefix, staging_buf + copied_size - staged_from, copysize);
+        DirtyBlock(block_entry);
         copied_size += copysize;
+        if (copysize == BLOCKSIZE && block_entry->block_number == DELAYED_BLOCK && IsZeroBlock(block)) {
+            DropDelayed(block_entry);
+        }
     }
     new_size += copied_size;
     if (new_size > inode->size) {
-        inode_entry->dirty = 1;
+        DirtyInode(inode_entry);
         inode->size = new_size;
     }
+    if (packet->arg1 == -5) {
+        TrimFileBlocks(inode_entry, end_index);
+        return;
+    }
     packet->arg1 = copied_size;
 }
 
 /**
  * Delete directory
 */
-void DeleteDir(DataPacket *packet) {
+void DeleteDir(DataPacket *packet, int pid) {
     int target_inum = packet->arg1;
     int parent_inum = packet->arg2;
+    void *target = packet->pointer;
 
     if (target_inum == ROOTINODE) {
         packet->arg1 = -1;
@@ -1261,39 +3621,54 @@ void DeleteDir(DataPacket *packet) {
         packet->arg1 = -3;
         return;
     }
-    if (target_inode->size > DIRSIZE * 2) {
+    if (!IsDirectoryEmpty(target_inode)) {
         packet->arg1 = -4;
         return;
     }
 
-    if (UnregisterDirectory(parent_inode, target_inum) < 0) {
+    char dirname[DIRNAMELEN];
+    if (target != NULL && CopyFromClient(pid, dirname, target, DIRNAMELEN) < 0) {
+        packet->arg1 = -5;
+        return;
+    }
+    if (UnregisterDirectory(parent_inum, parent_inode, target_inum, target != NULL ? dirname : NULL) < 0) {
         packet->arg1 = -5;
         return;
     }
 
-    target_entry->dirty = 1;
+    DirtyInode(target_entry);
     target_inode->type = INODE_FREE;
-    target_inode->size = 0;
     target_inode->nlink = 0;
+    ForgetDirectory(target_inum);
 
-    parent_entry->dirty = CleanDirectory(parent_inode);
+    if (CleanDirectory(parent_inode)) {
+        DirtyInode(parent_entry);
+    }
 
     struct block_cache_entry *block_entry;
     struct dir_entry *block;
 
     block_entry = SearchForBlock(target_inode->direct[0]);
-    block_entry->dirty = 1;
+    DirtyBlock(block_entry);
     block = block_entry->block;
 
     int i;
+    int dot_inums[2];
+    for (i = 0; i < 2; i++) {
+        dot_inums[i] = block[i].name[1] == '.' ? block[i].inum : 0;
+        block[i].inum = 0;
+    }
+
     for (i = 0; i < 2; i++) {
-        if (block[i].name[1] == '.') {
-            target_entry = SearchForInode(block[i].inum);
+        if (dot_inums[i] != 0) {
+            target_entry = SearchForInode(dot_inums[i]);
             target_entry->inode->nlink -= 1;
-            target_entry->dirty = 1;
+            DirtyInode(target_entry);
         }
-        block[i].inum = 0;
     }
+
+    ShortenInode(target_inum);
+    FreeInode(target_inum);
 }
 
 /**
@@ -1302,14 +3677,14 @@ void DeleteDir(DataPacket *packet) {
 void CreateLink(DataPacket *packet, int pid) {
     int target_inum = packet->arg1;
     int parent_inum = packet->arg2;
+    void *target = packet->pointer;
 
     memset(packet, 0, PACKET_SIZE);
     packet->packet_type = MSG_LINK;
     packet->arg1 = 0;
 
     char dirname[DIRNAMELEN];
-    void *target = packet->pointer;
-    if (CopyFrom(pid, dirname, target, DIRNAMELEN) < 0) {
+    if (CopyFromClient(pid, dirname, target, DIRNAMELEN) < 0) {
         packet->arg1 = -1;
         return;
     }
@@ -1329,22 +3704,30 @@ void CreateLink(DataPacket *packet, int pid) {
         packet->arg1 = -3;
         return;
     }
-    if (free_block_list->size < 2) {
+    if (AvailableBlocks() < 2) {
         packet->arg1 = -4;
         return;
     }
 
-    parent_entry->dirty = RegisterDirectory(parent_inode, target_inum, dirname);
-    target_entry->dirty = 1;
+    int registered = RegisterDirectory(parent_inum, parent_inode, target_inum, dirname);
+    if (registered < 0) {
+        packet->arg1 = -5;
+        return;
+    }
+    if (registered) {
+        DirtyInode(parent_entry);
+    }
+    DirtyInode(target_entry);
     target_inode->nlink = target_inode->nlink + 1;
 }
 
 /**
  * Delete link.
 */
-void DeleteLink(DataPacket *packet) {
+void DeleteLink(DataPacket *packet, int pid) {
     int target_inum = packet->arg1;
     int parent_inum = packet->arg2;
+    void *target = packet->pointer;
 
     memset(packet, 0, PACKET_SIZE);
     packet->packet_type = MSG_UNLINK;
@@ -1361,69 +3744,558 @@ void DeleteLink(DataPacket *packet) {
     struct inode_cache_entry *target_entry = SearchForInode(target_inum);
     struct inode *target_inode = target_entry->inode;
 
-    if (UnregisterDirectory(parent_inode, target_inum) < 0) {
+    char dirname[DIRNAMELEN];
+    if (target != NULL && CopyFromClient(pid, dirname, target, DIRNAMELEN) < 0) {
+        packet->arg1 = -2;
+        return;
+    }
+    if (UnregisterDirectory(parent_inum, parent_inode, target_inum, target != NULL ? dirname : NULL) < 0) {
         packet->arg1 = -2;
         return;
     }
 
-    target_entry->dirty = 1;
+    DirtyInode(target_entry);
     target_inode->nlink -= 1;
 
     if (target_inode->nlink == 0) {
         ShortenInode(target_inum);
         target_inode->type = INODE_FREE;
-        PushToBuffer(free_inode_list, target_inum);
+        FreeInode(target_inum);
+    }
+
+    if (CleanDirectory(parent_inode)) {
+        DirtyInode(parent_entry);
+    }
+}
+
+/**
+ * Order block cache entries by block number.
+ */
+int CompareBlockNumber(const void *a, const void *b) {
+    const struct block_cache_entry *x = *(struct block_cache_entry * const *)a;
+    const struct block_cache_entry *y = *(struct block_cache_entry * const *)b;
+    return x->block_number - y->block_number;
+}
+
+/**
+ * Write back the given dirty blocks in ascending block order.
+ */
+void WriteBackBlocks(struct block_cache_entry **blocks, int count) {
+    qsort(blocks, count, sizeof(struct block_cache_entry *), CompareBlockNumber);
+
+    int i;
+    for (i = 0; i < count; i++) {
+        NoteTransfer(blocks[i]->block_number, 0);
+        WriteSector(blocks[i]->block_number, blocks[i]->block);
+        server_stats.sector_writes++;
+        server_stats.block_writebacks++;
+        CleanBlock(blocks[i]);
     }
+}
+
+/**
+ * Order inode cache entries by inode number.
+ */
+int CompareInodeNumber(const void *a, const void *b) {
+    const struct inode_cache_entry *x = *(struct inode_cache_entry * const *)a;
+    const struct inode_cache_entry *y = *(struct inode_cache_entry * const *)b;
+    return x->inum - y->inum;
+}
+
+/**
+ * Write back the inode-table blocks holding dirty inodes, and the
+ * header's if it changed, in ascending order.
+ */
+void WriteDirtyInodes() {
+    struct inode_cache_entry** dirty_inodes = cache_for_inodes->scratch;
+    int dirty_count = 0;
+    int i;
+    for (i = 0; i < cache_for_inodes->stack_size; i++) {
+        if (cache_for_inodes->entries[i].dirty) {
+            dirty_inodes[dirty_count++] = &cache_for_inodes->entries[i];
+        }
+    }
+    qsort(dirty_inodes, dirty_count, sizeof(struct inode_cache_entry *), CompareInodeNumber);
 
-    parent_entry->dirty = CleanDirectory(parent_inode);
+    if (header_dirty) {
+        WriteInodeBlock(1);
+    }
+    for (i = 0; i < dirty_count; i++) {
+        if (dirty_inodes[i]->dirty) {
+            WriteInodeBlock(INODE_BLOCK(dirty_inodes[i]->inum));
+        }
+    }
 }
 
 /**
  * Sync cache.
+ *
+ * The bitmaps go first, then each inode-table block holding dirty
+ * inodes, written once with all of them.  The dirty blocks are then
+ * written in ascending block order, one sweep of the disk head.
  */
 void SyncCache() {
-    struct inode_cache_entry* inode;
-    for (inode = cache_for_inodes->top; inode != NULL; inode = inode->next_lru) {
-        if (inode->dirty) {
-            struct block_cache_entry* inode_block_entry = SearchForBlock((inode->inum / 8) + 1);
-            inode_block_entry->dirty = 1;
-            void* inode_block = inode_block_entry->block;
-            struct inode* overwrite = (struct inode *)inode_block + (inode->inum % 8);
-            memcpy(overwrite, inode->inode, sizeof(inode));
-            inode->dirty = 0;
+    AllocateDelayed();
+    SyncBitmaps();
+    WriteDirtyInodes();
+
+    struct block_cache_entry** dirty_blocks = cache_for_blocks->scratch;
+    int dirty_count = 0;
+    int i;
+    for (i = 0; i < cache_for_blocks->stack_size; i++) {
+        if (cache_for_blocks->entries[i].dirty) {
+            dirty_blocks[dirty_count++] = &cache_for_blocks->entries[i];
         }
     }
+    WriteBackBlocks(dirty_blocks, dirty_count);
+    return;
+}
 
-    struct block_cache_entry* block = cache_for_blocks->top;
-    while (block != NULL) {
-        if (block->dirty) {
-            WriteSector(block->block_number, block->block);
-            block->dirty = 0;
+/************
+ * Flusher *
+ ************/
+
+/**
+ * Number of dirty blocks and dirty cached inodes, the bitmaps counting
+ * as one inode.
+ */
+int CountDirty(int *dirty_inodes) {
+    *dirty_inodes = bitmaps_dirty + dirty_inode_count;
+    return dirty_block_count;
+}
+
+/**
+ * Write back the coldest dirty blocks, probation list first, until at
+ * most target blocks remain dirty.
+ */
+void FlushColdBlocks(int dirty_count, int target) {
+    struct block_cache_entry** cold_blocks = cache_for_blocks->scratch;
+    int cold_count = 0;
+    struct block_cache_entry* block;
+
+    for (block = cache_for_blocks->probation_base; block != NULL && dirty_count > target; block = block->prev_lru) {
+        if (block->dirty && block->block_number > 0) {
+            cold_blocks[cold_count++] = block;
+            dirty_count--;
         }
-        block = block->next_lru;
     }
-    return;
+    for (block = cache_for_blocks->base; block != NULL && dirty_count > target; block = block->prev_lru) {
+        if (block->dirty && block->block_number > 0) {
+            cold_blocks[cold_count++] = block;
+            dirty_count--;
+        }
+    }
+    WriteBackBlocks(cold_blocks, cold_count);
+}
+
+/**
+ * Body of the flusher process: poke the server every flush_ticks until
+ * it says to stop or goes away.
+ */
+void RunFlusher() {
+    DataPacket *packet = malloc(PACKET_SIZE);
+    while (1) {
+        Delay(flush_ticks);
+        memset(packet, 0, PACKET_SIZE);
+        packet->packet_type = MSG_FLUSH;
+        if (Send(packet, -FILE_SERVER) < 0 || packet->arg1 == 1) {
+            Exit(0);
+        }
+    }
+}
+
+/**
+ * Fork the flusher if it is enabled, not running, and there is
+ * something for it to write.
+ */
+void StartFlusher() {
+    int dirty_inodes;
+    if (flush_ticks <= 0 || flusher_pid != 0 || (CountDirty(&dirty_inodes) == 0 && dirty_inodes == 0)) {
+        return;
+    }
+
+    int pid = Fork();
+    if (pid == 0) {
+        RunFlusher();
+    }
+    if (pid > 0) {
+        flusher_pid = pid;
+        idle_flushes = 0;
+    }
+}
+
+/**
+ * Periodic flush: write back everything dirty.  The flusher is told to
+ * exit after FLUSH_IDLE_LIMIT flushes with no requests in between, so an
+ * idle server still blocks and lets the system halt; the next request
+ * that dirties the cache starts it again.
+ */
+void FlushCache(DataPacket *packet) {
+    int dirty_inodes;
+    int dirty_blocks = CountDirty(&dirty_inodes);
+
+    memset(packet, 0, PACKET_SIZE);
+    packet->packet_type = MSG_FLUSH;
+
+    if (dirty_blocks > 0 || dirty_inodes > 0) {
+        SyncCache();
+    }
+
+    if (requests_since_flush == 0) {
+        idle_flushes++;
+    } else {
+        idle_flushes = 0;
+    }
+    requests_since_flush = 0;
+
+    if (idle_flushes >= FLUSH_IDLE_LIMIT) {
+        packet->arg1 = 1;
+        flusher_pid = 0;
+    }
+}
+
+/****************
+ * Cache budget *
+ ****************/
+
+/**
+ * Give the block, inode and name caches their first sizes: the fixed
+ * defaults, or shares of cache_budget when one is set.
+ */
+void SplitCacheBudget(int num_inodes, int num_blocks) {
+    int blocks = BLOCK_CACHESIZE;
+    int inodes = INODE_CACHE_ENTRIES;
+    int names = NAME_CACHESIZE;
+
+    if (cache_budget > 0) {
+        blocks = cache_budget / 100 * BLOCK_SHARE / BLOCK_ENTRY_BYTES;
+        inodes = cache_budget / 100 * INODE_SHARE / INODE_ENTRY_BYTES;
+        names = cache_budget / 100 * (100 - BLOCK_SHARE - INODE_SHARE) / NAME_ENTRY_BYTES;
+        if (blocks < BLOCK_CACHESIZE) blocks = BLOCK_CACHESIZE;
+        if (inodes < INODE_CACHESIZE) inodes = INODE_CACHESIZE;
+        if (names < NAME_CACHE_MIN) names = NAME_CACHE_MIN;
+    }
+
+    cache_for_inodes = MakeInodeCache(num_inodes, inodes);
+    cache_for_blocks = MakeBlockCache(num_blocks, blocks);
+    cache_for_names = MakeNameCache(names);
+    readahead_limit = READAHEAD_MAX;
+}
+
+/**
+ * Rebuild the block cache with the given number of slots, keeping the
+ * most recently used blocks of each list.  Dropped blocks are written
+ * back if dirty and remembered as evicted.  Returns -1, leaving the
+ * cache as it was, if some delayed blocks could not be given one.
+ */
+int ResizeBlockCache(int entries) {
+    AllocateDelayed();
+    if (delayed_count > 0) {
+        return -1;
+    }
+
+    struct block_cache *old = cache_for_blocks;
+    struct block_cache_entry **held = old->scratch;
+    int held_count = 0;
+    struct block_cache_entry *entry;
+    for (entry = old->top; entry != NULL; entry = entry->next_lru) {
+        if (entry->block_number > 0) held[held_count++] = entry;
+    }
+    for (entry = old->probation_top; entry != NULL; entry = entry->next_lru) {
+        if (entry->block_number > 0) held[held_count++] = entry;
+    }
+    int keep_count = held_count < entries ? held_count : entries;
+
+    struct block_cache *new_cache = MakeBlockCache(block_count, entries);
+    int i;
+    for (i = keep_count - 1; i >= 0; i--) {
+        struct block_cache_entry *slot = new_cache->base;
+        UnlinkBlock(&new_cache->top, &new_cache->base, slot);
+        memcpy(slot->block, held[i]->block, SECTORSIZE);
+        slot->block_number = held[i]->block_number;
+        slot->dirty = held[i]->dirty;
+        slot->readahead = held[i]->readahead;
+        slot->on_probation = held[i]->on_probation;
+        HashBlock(new_cache, slot);
+        if (slot->on_probation) {
+            PushBlock(&new_cache->probation_top, &new_cache->probation_base, slot);
+            new_cache->probation_count++;
+        } else {
+            PushBlock(&new_cache->top, &new_cache->base, slot);
+        }
+    }
+
+    int dirty_count = 0;
+    for (i = keep_count; i < held_count; i++) {
+        NoteGhost(new_cache->evicted, held[i]->block_number);
+        if (held[i]->dirty) {
+            held[keep_count + dirty_count++] = held[i];
+        }
+    }
+    WriteBackBlocks(held + keep_count, dirty_count);
+
+    FreeGhostList(old->ghosts);
+    FreeGhostList(old->evicted);
+    free(old->hash_set);
+    free(old->entries);
+    free(old->arena_base);
+    free(old->scratch);
+    free(old);
+    if (readahead_limit > READAHEAD_MAX) {
+        readahead_limit = READAHEAD_MAX;
+    }
+    return 0;
+}
+
+/**
+ * Rebuild the inode cache with the given number of entries, keeping
+ * the most recently used inodes.  Dirty inodes are written first.
+ */
+void ResizeInodeCache(int entries) {
+    WriteDirtyInodes();
+
+    struct inode_cache *old = cache_for_inodes;
+    struct inode_cache_entry **held = old->scratch;
+    int held_count = 0;
+    struct inode_cache_entry *entry;
+    for (entry = old->top; entry != NULL; entry = entry->next_lru) {
+        if (entry->inum >= 0) held[held_count++] = entry;
+    }
+    int keep_count = held_count < entries ? held_count : entries;
+
+    struct inode_cache *new_cache = MakeInodeCache(inode_count, entries);
+    int i;
+    for (i = keep_count - 1; i >= 0; i--) {
+        struct inode_cache_entry *slot = new_cache->base;
+        struct inode_cache_entry links = *slot;
+        *slot = *held[i];
+        slot->inode = links.inode;
+        slot->prev_lru = links.prev_lru;
+        slot->next_lru = links.next_lru;
+        memcpy(slot->inode, held[i]->inode, sizeof(struct inode));
+        HashInode(new_cache, slot);
+        PopToFrontInode(new_cache, slot);
+    }
+    for (i = keep_count; i < held_count; i++) {
+        ReleaseReservation(held[i]);
+        NoteGhost(new_cache->evicted, held[i]->inum);
+    }
+
+    FreeGhostList(old->evicted);
+    free(old->hash_set);
+    free(old->entries);
+    free(old->arena);
+    free(old->scratch);
+    free(old);
+}
+
+/**
+ * Rebuild the name cache with the given number of entries by entering
+ * the old names again, least recently used first.
+ */
+void ResizeNameCache(int entries) {
+    struct name_cache *old = cache_for_names;
+    MakeNameCache(entries);
+
+    struct name_cache_entry *entry;
+    for (entry = old->base; entry != NULL; entry = entry->prev_lru) {
+        if (entry->parent_inum >= 0) {
+            EnterName(entry->parent_inum, entry->name, entry->inum);
+        }
+    }
+
+    FreeGhostList(old->evicted);
+    free(old->hash_set);
+    free(old->entries);
+    free(old);
+}
+
+/**
+ * Resize cache 0 (blocks), 1 (inodes) or 2 (names).  Returns -1 if the
+ * cache was left as it was.
+ */
+int ResizeCache(int cache, int entries) {
+    if (cache == 0) {
+        return ResizeBlockCache(entries);
+    }
+    if (cache == 1) {
+        ResizeInodeCache(entries);
+    } else {
+        ResizeNameCache(entries);
+    }
+    return 0;
+}
+
+/**
+ * Every ADAPT_INTERVAL requests under a budget, move a step of the
+ * budget from the cache whose ghost hits per byte were lowest to the
+ * one whose were highest.  A ghost hit is a miss on something the
+ * cache evicted recently, so it is the miss more capacity would save.
+ */
+void AdaptCaches() {
+    static int last_hits[3];
+    if (cache_budget == 0 || ++requests_since_adapt < ADAPT_INTERVAL) {
+        return;
+    }
+    requests_since_adapt = 0;
+
+    int hits[3] = {server_stats.block_ghost_hits, server_stats.inode_ghost_hits, server_stats.name_ghost_hits};
+    int sizes[3] = {cache_for_blocks->stack_size, cache_for_inodes->stack_size, cache_for_names->stack_size};
+    int bytes[3] = {BLOCK_ENTRY_BYTES, INODE_ENTRY_BYTES, NAME_ENTRY_BYTES};
+    int mins[3] = {BLOCK_CACHESIZE, INODE_CACHESIZE, NAME_CACHE_MIN};
+    double score[3];
+    int best = 0;
+    int i;
+    for (i = 0; i < 3; i++) {
+        score[i] = (double)(hits[i] - last_hits[i]) / ((double)sizes[i] * bytes[i]);
+        if (score[i] > score[best]) best = i;
+    }
+    int worst = -1;
+    for (i = 0; i < 3; i++) {
+        if (i != best && sizes[i] > mins[i] && (worst < 0 || score[i] < score[worst])) worst = i;
+    }
+    if (hits[best] - last_hits[best] < ADAPT_MIN_HITS || worst < 0 || score[worst] >= score[best]) {
+        memcpy(last_hits, hits, sizeof(hits));
+        return;
+    }
+    memcpy(last_hits, hits, sizeof(hits));
+
+    int maxes[3] = {block_count, inode_count, cache_budget / NAME_ENTRY_BYTES};
+    int grow = cache_budget / ADAPT_STEPS / bytes[best];
+    if (sizes[best] + grow > maxes[best]) grow = maxes[best] - sizes[best];
+    int shrink = (grow * bytes[best] + bytes[worst] - 1) / bytes[worst];
+    if (sizes[worst] - shrink < mins[worst]) shrink = sizes[worst] - mins[worst];
+    grow = shrink * bytes[worst] / bytes[best];
+    if (grow < 1) {
+        return;
+    }
+
+    /* Only the block cache can refuse, so it goes first: the step is
+     * taken whole or not at all. */
+    if (best == 0) {
+        if (ResizeCache(best, sizes[best] + grow) < 0) return;
+        ResizeCache(worst, sizes[worst] - shrink);
+    } else {
+        if (ResizeCache(worst, sizes[worst] - shrink) < 0) return;
+        ResizeCache(best, sizes[best] + grow);
+    }
+    server_stats.cache_resizes++;
+}
+
+/**
+ * Copy server counters to the client.
+ */
+void GetStats(DataPacket *packet, int pid) {
+    void *target = packet->pointer;
+
+    memset(packet, 0, PACKET_SIZE);
+    packet->packet_type = MSG_STATS;
+    server_stats.free_blocks = AvailableBlocks();
+    server_stats.free_inodes = BufferCount(free_inode_list);
+
+    if (CopyToClient(pid, target, &server_stats, sizeof(ServerStats)) < 0) {
+        packet->arg1 = -1;
+    }
+}
+
+/**
+ * Drain the oldest trace events into the client's buffer.
+ */
+void GetTrace(DataPacket *packet, int pid) {
+    void *target = packet->pointer;
+    int room = packet->arg1;
+
+    memset(packet, 0, PACKET_SIZE);
+    packet->packet_type = MSG_TRACE;
+    if (trace_ring == NULL || room < 0) {
+        packet->arg1 = -1;
+        return;
+    }
+
+    int count = trace_count < room ? trace_count : room;
+    int first = TraceStart();
+    int head = count < TRACE_EVENTS - first ? count : TRACE_EVENTS - first;
+    if (CopyToClient(pid, target, trace_ring + first, head * sizeof(TraceEvent)) < 0 ||
+        CopyToClient(pid, (TraceEvent *)target + head, trace_ring, (count - head) * sizeof(TraceEvent)) < 0) {
+        packet->arg1 = -1;
+        return;
+    }
+    trace_count -= count;
+    packet->arg1 = count;
+    packet->arg2 = trace_lost;
+    trace_lost = 0;
+}
+
+/**
+ * Count a request of the given type that was received at start.
+ */
+void NoteService(int type, long long start) {
+    if (type < 0 || type >= MSG_TYPES) {
+        return;
+    }
+    MessageStats *stats = &server_stats.messages[type];
+    int elapsed = (int)(ServiceClock() - start);
+    stats->count++;
+    stats->total_us += elapsed;
+    if (elapsed > stats->max_us) {
+        stats->max_us = elapsed;
+    }
 }
 
 /**
  * Execute based on packet.
 */
 int main(int argc, char **argv) {
-    (void)argc;
+    int arg = 1;
+    while (arg < argc - 1 && argv[arg][0] == '-') {
+        if (strcmp(argv[arg], "-c") == 0 && strcmp(argv[arg + 1], "lru") == 0) {
+            block_policy = CACHE_LRU;
+        } else if (strcmp(argv[arg], "-c") == 0 && strcmp(argv[arg + 1], "2q") == 0) {
+            block_policy = CACHE_2Q;
+        } else if (strcmp(argv[arg], "-f") == 0) {
+            flush_ticks = atoi(argv[arg + 1]);
+        } else if (strcmp(argv[arg], "-m") == 0) {
+            cache_budget = atoi(argv[arg + 1]) * 1024;
+        } else if (strcmp(argv[arg], "-T") == 0) {
+            trace_file = argv[arg + 1];
+            trace_ring = malloc(TRACE_EVENTS * sizeof(TraceEvent));
+        } else if (strcmp(argv[arg], "-R") == 0) {
+            if ((record_file = fopen(argv[arg + 1], "wb")) == NULL) {
+                fprintf(stderr, "Cannot record to %s.\n", argv[arg + 1]);
+                return -1;
+            }
+        } else if (strcmp(argv[arg], "-i") == 0) {
+            index_directories = 1;
+            arg++;
+            continue;
+        } else {
+            fprintf(stderr, USAGE);
+            return -1;
+        }
+        arg += 2;
+    }
+    if (arg >= argc) {
+        fprintf(stderr, USAGE);
+        return -1;
+    }
 
     Register(FILE_SERVER);
     void *sector_one = malloc(SECTORSIZE);
+    server_stats.sector_reads++;
     if (ReadSector(1, sector_one) != 0) {
         printf("Error\n");
     }
     else {
         file_system_header = (struct fs_header *)sector_one;
     }
+    LoadFormat();
 
-    cache_for_inodes = MakeInodeCache(file_system_header->num_inodes);
-    cache_for_blocks = MakeBlockCache(file_system_header->num_blocks);
-    PushFreeInodeList();
-    GetFreeBlockList();
+    SplitCacheBudget(file_system_header->num_inodes, file_system_header->num_blocks);
+    if (LoadBitmaps()) {
+        ReadFreeLists();
+    } else {
+        ScanFreeLists();
+    }
 
     int pid;
   	if ((pid = Fork()) < 0) {
@@ -1432,7 +4304,7 @@ int main(int argc, char **argv) {
   	}
 
     if (pid == 0) {
-        Exec(argv[1], argv + 1);
+        Exec(argv[arg], argv + arg);
         fprintf(stderr, "Cannot Exec.\n");
         return -1;
     }
@@ -1447,6 +4319,10 @@ int main(int argc, char **argv) {
         if (pid == 0) {
             continue;
         }
+        long long start = ServiceClock();
+        int type = ((UnknownPacket *)packet)->packet_type;
+        Trace(TRACE_REQUEST_START, type, pid);
+        StartRecord(packet, pid);
 
         if (((UnknownPacket *)packet)->packet_type == MSG_GET_FILE) {
             GetFile(packet);
@@ -1461,24 +4337,62 @@ int main(int argc, char **argv) {
         } else if (((UnknownPacket *)packet)->packet_type == MSG_CREATE_DIR) {
             CreateFile(packet, pid, INODE_DIRECTORY);
         } else if (((UnknownPacket *)packet)->packet_type == MSG_DELETE_DIR) {
-            DeleteDir(packet);
+            DeleteDir(packet, pid);
         } else if (((UnknownPacket *)packet)->packet_type == MSG_LINK) {
             CreateLink(packet, pid);
         } else if (((UnknownPacket *)packet)->packet_type == MSG_UNLINK) {
-            DeleteLink(packet);
+            DeleteLink(packet, pid);
         } else if (((UnknownPacket *)packet)->packet_type == MSG_SYNC) {
             SyncCache();
+            if (record_file != NULL) {
+                fflush(record_file);
+            }
             if (((DataPacket *)packet)->arg1 == 1) {
+                FinishRecord(packet, start);
+                if (record_file != NULL) {
+                    fclose(record_file);
+                }
                 Reply(packet, pid);
-                printf("Shutdown by pid: %d.\n", pid);
+                Trace(TRACE_REQUEST_END, type, pid);
+                DumpTrace();
+                fprintf(stderr, "Shutdown by pid: %d.\n", pid);
                 Exit(0);
             }
+        } else if (((UnknownPacket *)packet)->packet_type == MSG_STATS) {
+            GetStats(packet, pid);
+        } else if (((UnknownPacket *)packet)->packet_type == MSG_FLUSH) {
+            FlushCache(packet);
+        } else if (((UnknownPacket *)packet)->packet_type == MSG_RESOLVE_PATH) {
+            ResolvePath(packet, pid);
+        } else if (((UnknownPacket *)packet)->packet_type == MSG_TRACE) {
+            GetTrace(packet, pid);
+        }
+
+        if (((UnknownPacket *)packet)->packet_type != MSG_FLUSH) {
+            requests_since_flush++;
         }
 
+        FinishRecord(packet, start);
         if (Reply(packet, pid) < 0) {
             fprintf(stderr, "Reply Error.\n");
             return -1;
         }
+        NoteService(type, start);
+        Trace(TRACE_REQUEST_END, type, pid);
+
+        // With the client released, prefetch, and write back cold blocks so misses find clean victims.
+        start = ServiceClock();
+        ReadAhead();
+
+        int dirty_inodes;
+        int dirty_blocks = CountDirty(&dirty_inodes);
+        if (dirty_blocks > DIRTY_HIGH) {
+            FlushColdBlocks(dirty_blocks, DIRTY_LOW);
+        }
+        AdaptCaches();
+        server_stats.after_reply_us += ServiceClock() - start;
+        Trace(TRACE_AFTER_REPLY_END, type, pid);
+        StartFlusher();
     }
 
     return 0;
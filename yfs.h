@@ -14,4 +14,28 @@ struct cache {
 struct linkedList {
 
 };
+
+/*
+ * Allocation bitmaps.  mkyfs puts a free-block bitmap and then an inode
+ * bitmap (one bit each, set when in use) in the last blocks of the
+ * disk, and records them in spare fs_header padding slots.  The clean
+ * slot is 1 only while the bitmaps on disk match the rest of the file
+ * system; otherwise the server rebuilds them by scanning the inodes.
+ */
+#define FS_MAGIC                0x59465342
+#define FS_MAGIC_SLOT           0
+#define FS_BLOCK_BITMAP_SLOT    1
+#define FS_INODE_BITMAP_SLOT    2
+#define FS_CLEAN_SLOT           3
+#define BITS_PER_BLOCK          (BLOCKSIZE * 8)
+#define BITMAP_BLOCKS(bits)     (((bits) + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK)
+
+/*
+ * Block mapping format.  When the format slot holds FS_FORMAT_DOUBLE,
+ * the last pointer of a file's indirect block names a double-indirect
+ * block, whose pointers name blocks of data block pointers.  Any other
+ * value means the original single-indirect layout.
+ */
+#define FS_FORMAT_SLOT          4
+#define FS_FORMAT_DOUBLE        2
 #endif //COMP421_LAB3_YFS_H